@@ -22,6 +22,14 @@
 #define F(x)   (((x)<<1) ^ ((((x)>>7) & 1) * 0x1b))
 #define FD(x)  (((x) >> 1) ^ (((x) & 1) ? 0x8d : 0))
 
+#if defined(AES128)
+#define KEY_EXPANSIONS 10   /* one per round key */
+#define RCON_LAST      0x6c /* rcon after the last expansion */
+#else
+#define KEY_EXPANSIONS 7    /* one per two round keys */
+#define RCON_LAST      0x80
+#endif
+
 #ifdef BACK_TO_TABLES
 
 #if defined(__AVR__)
@@ -177,16 +185,26 @@ uint8_t sboxinv[256];
 /* -------------------------------------------------------------------------- */
 void aes256_init_sboxes(void) // pregenerate tables at startup
 {
-  uint8_t i = 0;
+  // Walk all powers p = 3^i once, q = 3^-i is the inverse of p. This replaces
+  // rj_sbox_calc(), whose gf_log() loops up to 255 times for every entry.
+  uint8_t p = 1, q = 1, y, sb;
   do {
-    sbox[i] = rj_sbox_calc(i);
-    i++;
-  } while (i);
-  i = 0;
-  do {
-    sboxinv[i] = rj_sbox_inv_calc(i);
-    i++;
-  } while (i);
+    p ^= (p << 1) ^ ((p & 0x80) ? 0x1b : 0);          // p * 3
+    q ^= q << 1; q ^= q << 2; q ^= q << 4;            // q / 3
+    if (q & 0x80) q ^= 0x09;
+
+    sb = y = q;
+    y = (y<<1)|(y>>7); sb ^= y;  y = (y<<1)|(y>>7); sb ^= y;
+    y = (y<<1)|(y>>7); sb ^= y;  y = (y<<1)|(y>>7); sb ^= y;
+    sb ^= 0x63;
+
+    sbox[p] = sb;
+    sboxinv[sb] = p;
+  } while (p != 1);
+
+  // 0 has no inverse
+  sbox[0] = 0x63;
+  sboxinv[0x63] = 0;
 } /* aes256_init_sboxes */
 
 #else
@@ -228,13 +246,19 @@ void aes_addRoundKey(uint8_t *buf, uint8_t *key)
     while (i--) buf[i] ^= key[i];
 } /* aes_addRoundKey */
 
+#if !defined(AES256_KEY_SCHEDULE)
 /* -------------------------------------------------------------------------- */
 void aes_addRoundKey_cpy(uint8_t *buf, uint8_t *key, uint8_t *cpk)
 {
     register uint8_t i = 16;
 
+#if defined(AES128)
+    while (i--)  buf[i] ^= (cpk[i] = key[i]);
+#else
     while (i--)  buf[i] ^= (cpk[i] = key[i]), cpk[16+i] = key[16 + i];
+#endif
 } /* aes_addRoundKey_cpy */
+#endif
 
 
 /* -------------------------------------------------------------------------- */
@@ -291,6 +315,42 @@ void aes_mixColumns_inv(uint8_t *buf)
     }
 } /* aes_mixColumns_inv */
 
+#if defined(AES128)
+
+/* -------------------------------------------------------------------------- */
+void aes_expandEncKey(uint8_t *k, uint8_t *rc)
+{
+    register uint8_t i;
+
+    k[0] ^= rj_sbox(k[13]) ^ (*rc);
+    k[1] ^= rj_sbox(k[14]);
+    k[2] ^= rj_sbox(k[15]);
+    k[3] ^= rj_sbox(k[12]);
+    *rc = F( *rc);
+
+    for(i = 4; i < 16; i++) k[i] ^= k[i-4];
+} /* aes_expandEncKey */
+
+#if !defined(AES256_KEY_SCHEDULE)
+
+/* -------------------------------------------------------------------------- */
+void aes_expandDecKey(uint8_t *k, uint8_t *rc)
+{
+    uint8_t i;
+
+    for(i = 15; i > 3; i--) k[i] ^= k[i-4];
+
+    *rc = FD(*rc);
+    k[0] ^= rj_sbox(k[13]) ^ (*rc);
+    k[1] ^= rj_sbox(k[14]);
+    k[2] ^= rj_sbox(k[15]);
+    k[3] ^= rj_sbox(k[12]);
+} /* aes_expandDecKey */
+
+#endif
+
+#else /* AES-256 */
+
 /* -------------------------------------------------------------------------- */
 void aes_expandEncKey(uint8_t *k, uint8_t *rc)
 {
@@ -314,6 +374,8 @@ void aes_expandEncKey(uint8_t *k, uint8_t *rc)
 
 } /* aes_expandEncKey */
 
+#if !defined(AES256_KEY_SCHEDULE)
+
 /* -------------------------------------------------------------------------- */
 void aes_expandDecKey(uint8_t *k, uint8_t *rc)
 {
@@ -337,6 +399,74 @@ void aes_expandDecKey(uint8_t *k, uint8_t *rc)
     k[3] ^= rj_sbox(k[28]);
 } /* aes_expandDecKey */
 
+#endif
+
+#endif
+
+
+#if defined(AES256_KEY_SCHEDULE)
+
+/* -------------------------------------------------------------------------- */
+void aes256_init_ecb(aes256_context *ctx, uint8_t *k)
+{
+    uint8_t rcon = 1, key[AES_KEY_LENGTH];
+    register uint8_t i;
+
+    for (i = 0; i < sizeof(key); i++) ctx->schedule[i] = key[i] = k[i];
+    for (i = sizeof(key); i < sizeof(ctx->schedule); i++)
+    {
+        if (!(i & (sizeof(key) - 1))) aes_expandEncKey(key, &rcon);
+        ctx->schedule[i] = key[i & (sizeof(key) - 1)];
+    }
+    for (i = 0; i < sizeof(key); i++) key[i] = 0;
+} /* aes256_init_ecb */
+
+/* -------------------------------------------------------------------------- */
+void aes256_done(aes256_context *ctx)
+{
+    register uint8_t i;
+
+    for (i = 0; i < sizeof(ctx->schedule); i++) ctx->schedule[i] = 0;
+} /* aes256_done */
+
+/* -------------------------------------------------------------------------- */
+void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf)
+{
+    uint8_t i;
+
+    aes_addRoundKey(buf, ctx->schedule);
+    for(i = 1; i < AES_ROUNDS; ++i)
+    {
+        aes_subBytes(buf);
+        aes_shiftRows(buf);
+        aes_mixColumns(buf);
+        aes_addRoundKey(buf, &ctx->schedule[16 * i]);
+    }
+    aes_subBytes(buf);
+    aes_shiftRows(buf);
+    aes_addRoundKey(buf, &ctx->schedule[16 * AES_ROUNDS]);
+} /* aes256_encrypt */
+
+/* -------------------------------------------------------------------------- */
+void aes256_decrypt_ecb(aes256_context *ctx, uint8_t *buf)
+{
+    uint8_t i;
+
+    aes_addRoundKey(buf, &ctx->schedule[16 * AES_ROUNDS]);
+    aes_shiftRows_inv(buf);
+    aes_subBytes_inv(buf);
+
+    for (i = AES_ROUNDS; --i;)
+    {
+        aes_addRoundKey(buf, &ctx->schedule[16 * i]);
+        aes_mixColumns_inv(buf);
+        aes_shiftRows_inv(buf);
+        aes_subBytes_inv(buf);
+    }
+    aes_addRoundKey(buf, ctx->schedule);
+} /* aes256_decrypt */
+
+#else /* round keys calculated on the fly */
 
 /* -------------------------------------------------------------------------- */
 void aes256_init_ecb(aes256_context *ctx, uint8_t *k)
@@ -345,7 +475,7 @@ void aes256_init_ecb(aes256_context *ctx, uint8_t *k)
     register uint8_t i;
 
     for (i = 0; i < sizeof(ctx->key); i++) ctx->enckey[i] = ctx->deckey[i] = k[i];
-    for (i = 8;--i;) aes_expandEncKey(ctx->deckey, &rcon);
+    for (i = KEY_EXPANSIONS + 1;--i;) aes_expandEncKey(ctx->deckey, &rcon);
 } /* aes256_init_ecb */
 
 /* -------------------------------------------------------------------------- */
@@ -363,13 +493,17 @@ void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf)
     uint8_t i, rcon;
 
     aes_addRoundKey_cpy(buf, ctx->enckey, ctx->key);
-    for(i = 1, rcon = 1; i < 14; ++i)
+    for(i = 1, rcon = 1; i < AES_ROUNDS; ++i)
     {
         aes_subBytes(buf);
         aes_shiftRows(buf);
         aes_mixColumns(buf);
+#if defined(AES128)
+        aes_expandEncKey(ctx->key, &rcon), aes_addRoundKey(buf, ctx->key);
+#else
         if( i & 1 ) aes_addRoundKey( buf, &ctx->key[16]);
         else aes_expandEncKey(ctx->key, &rcon), aes_addRoundKey(buf, ctx->key);
+#endif
     }
     aes_subBytes(buf);
     aes_shiftRows(buf);
@@ -386,17 +520,27 @@ void aes256_decrypt_ecb(aes256_context *ctx, uint8_t *buf)
     aes_shiftRows_inv(buf);
     aes_subBytes_inv(buf);
 
-    for (i = 14, rcon = 0x80; --i;)
+    for (i = AES_ROUNDS, rcon = RCON_LAST; --i;)
     {
+#if defined(AES128)
+        aes_expandDecKey(ctx->key, &rcon);
+        aes_addRoundKey(buf, ctx->key);
+#else
         if( ( i & 1 ) )
         {
             aes_expandDecKey(ctx->key, &rcon);
             aes_addRoundKey(buf, &ctx->key[16]);
         }
         else aes_addRoundKey(buf, ctx->key);
+#endif
         aes_mixColumns_inv(buf);
         aes_shiftRows_inv(buf);
         aes_subBytes_inv(buf);
     }
+#if defined(AES128)
+    aes_expandDecKey(ctx->key, &rcon);
+#endif
     aes_addRoundKey( buf, ctx->key);
 } /* aes256_decrypt */
+
+#endif
@@ -33,13 +33,52 @@ extern "C" {
 //#define BACK_TO_TABLES
 //#define STARTUP_TABLES
 
+// Key size, AES-256 unless the makefile selects AES-128 with -DAES128.
+// The host engine supports both at run time, see aes256_init_key().
+#if defined(AES128)
+#define AES_KEY_LENGTH      16
+#define AES_ROUNDS          10
+#else
+#define AES_KEY_LENGTH      32
+#define AES_ROUNDS          14
+#endif
+
+#if defined(AES256_HOST)
+// Host engine (aes_host.c), stores the fully expanded key schedule.
+// The words are used by the T-table code, the bytes by AES-NI.
+typedef struct {
+    union {
+        uint32_t words[60];
+        uint8_t bytes[240];
+    } enckey, deckey;
+    uint8_t engine;
+    uint8_t rounds;
+} aes256_context;
+
+#define AES256_ENGINE_TTABLE    0
+#define AES256_ENGINE_AESNI     1
+#define AES256_ENGINE_VAES      2
+
+int aes256_get_engine(void);
+void aes256_set_engine(int engine);
+
+// aes256_init_ecb() with a key of 16 (AES-128) or 32 (AES-256) bytes
+void aes256_init_key(aes256_context *, const uint8_t * /* key */, int /* length */);
+#elif defined(AES256_KEY_SCHEDULE)
+// All round keys, expanded once by aes256_init_ecb(). AES-256 needs
+// 144 bytes more RAM than the round keys calculated on the fly.
+typedef struct {
+    uint8_t schedule[16 * (AES_ROUNDS + 1)];
+} aes256_context;
+#else
 typedef struct {
-    uint8_t key[32];
-    uint8_t enckey[32];
-    uint8_t deckey[32];
+    uint8_t key[AES_KEY_LENGTH];
+    uint8_t enckey[AES_KEY_LENGTH];
+    uint8_t deckey[AES_KEY_LENGTH];
 } aes256_context;
+#endif
 
-#if !defined(BACK_TO_TABLES) && defined(STARTUP_TABLES)
+#if !defined(BACK_TO_TABLES) && defined(STARTUP_TABLES) && !defined(AES256_HOST)
 #if defined(__AVR__)
 void aes256_init_sboxes(void) __attribute__ ((used, naked, section (".init5")));
 #else
@@ -21,6 +21,10 @@ static inline void aes256CbcDecrypt(aes256_ctx_t *ctx, uint8_t *data, const size
 // CBC-MAC functions
 static inline void aes256CbcMacCalculate(aes256_ctx_t* ctx, uint8_t *data, const size_t dataLen);
 static inline bool aes256CbcMacReverseCompare(aes256_context* ctx, uint8_t* data, const size_t dataLen);
+#if defined(AES256_HOST)
+// Host only, implemented in aes_host.c
+void aes256CbcMacCalculateMulti(aes256_ctx_t* ctx, uint8_t* data[], const size_t count, const size_t dataLen);
+#endif
 
 // DEFINES
 #define AES256_CBC_LENGTH     16
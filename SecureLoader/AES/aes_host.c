@@ -0,0 +1,407 @@
+/*
+*   Table based AES-256 implementation for the host tools.
+*   Uses AES-NI if the CPU supports it, otherwise 32 bit T-tables.
+*   Provides the same functions as aes.c, build with -DAES256_HOST
+*   and link this file instead of aes.c.
+*
+*   The AVR bootloader keeps using the small tableless aes.c.
+*/
+#include <string.h>
+#include "aes.h"
+#include "aes256_cbc.h"
+
+#if !defined(AES256_HOST)
+#error "Define AES256_HOST to use the host AES engine."
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES256_HAVE_AESNI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define GETU32(p) (((uint32_t)(p)[0] << 24) ^ ((uint32_t)(p)[1] << 16) ^ \
+                   ((uint32_t)(p)[2] <<  8) ^ ((uint32_t)(p)[3]))
+#define PUTU32(p, v) { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); \
+                       (p)[2] = (uint8_t)((v) >>  8); (p)[3] = (uint8_t)(v); }
+#define ROR8(x) (((x) >> 8) | ((x) << 24))
+
+static uint8_t sbox[256];
+static uint8_t sboxinv[256];
+static uint32_t Te0[256], Te1[256], Te2[256], Te3[256];
+static uint32_t Td0[256], Td1[256], Td2[256], Td3[256];
+
+static int engine = AES256_ENGINE_TTABLE;
+static int engine_max = AES256_ENGINE_TTABLE;
+
+/* -------------------------------------------------------------------------- */
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t p = 0;
+
+    while (b) {
+        if (b & 1) p ^= a;
+        a = (a << 1) ^ ((a & 0x80) ? 0x1b : 0);
+        b >>= 1;
+    }
+    return p;
+} /* gf_mul */
+
+/* -------------------------------------------------------------------------- */
+static void __attribute__ ((constructor)) aes256_init_tables(void)
+{
+    uint8_t alog[256], log[256];
+    uint8_t x = 1;
+    int i;
+
+    // Walk the powers of the generator 3 once to get log and anti-log
+    for (i = 0; i < 255; i++) {
+        alog[i] = x;
+        log[x] = i;
+        x ^= (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint8_t inv = i ? alog[(255 - log[i]) % 255] : 0;
+        uint8_t s = inv ^ 0x63;
+        s ^= (inv << 1) | (inv >> 7);
+        s ^= (inv << 2) | (inv >> 6);
+        s ^= (inv << 3) | (inv >> 5);
+        s ^= (inv << 4) | (inv >> 4);
+        sbox[i] = s;
+        sboxinv[s] = i;
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint8_t s = sbox[i], si = sboxinv[i];
+        uint32_t e = ((uint32_t)gf_mul(s, 2) << 24) | (s << 16) | (s << 8) | gf_mul(s, 3);
+        uint32_t d = ((uint32_t)gf_mul(si, 14) << 24) | (gf_mul(si, 9) << 16) |
+                     (gf_mul(si, 13) << 8) | gf_mul(si, 11);
+        Te0[i] = e; Te1[i] = ROR8(e); Te2[i] = ROR8(Te1[i]); Te3[i] = ROR8(Te2[i]);
+        Td0[i] = d; Td1[i] = ROR8(d); Td2[i] = ROR8(Td1[i]); Td3[i] = ROR8(Td2[i]);
+    }
+
+#ifdef AES256_HAVE_AESNI
+    unsigned int a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES)) {
+        engine_max = AES256_ENGINE_AESNI;
+
+        // VAES needs AVX2 and the OS has to save the YMM registers
+        unsigned int xcr0_lo = 0, xcr0_hi = 0;
+        if (c & bit_OSXSAVE) {
+            __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        }
+        if ((xcr0_lo & 6) == 6 && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+            (b & bit_AVX2) && (c & (1 << 9))) {
+            engine_max = AES256_ENGINE_VAES;
+        }
+    }
+#endif
+    engine = engine_max;
+} /* aes256_init_tables */
+
+/* -------------------------------------------------------------------------- */
+int aes256_get_engine(void)
+{
+    return engine;
+} /* aes256_get_engine */
+
+/* -------------------------------------------------------------------------- */
+void aes256_set_engine(int e)
+{
+    // Only engines supported by the CPU can be selected
+    if (e >= AES256_ENGINE_TTABLE && e <= engine_max) engine = e;
+} /* aes256_set_engine */
+
+/* -------------------------------------------------------------------------- */
+void aes256_init_key(aes256_context *ctx, const uint8_t *k, int length)
+{
+    uint32_t *rk = ctx->enckey.words;
+    uint32_t *dk = ctx->deckey.words;
+    int nk = (length == 16) ? 4 : 8;
+    int rounds = nk + 6;
+    uint8_t rcon = 1;
+    int i, j;
+
+    ctx->rounds = rounds;
+    for (i = 0; i < nk; i++) rk[i] = GETU32(k + 4 * i);
+    for (i = nk; i < 4 * (rounds + 1); i++) {
+        uint32_t t = rk[i - 1];
+        if (i % nk == 0) {
+            t = ((uint32_t)sbox[(t >> 16) & 0xff] << 24) ^ ((uint32_t)sbox[(t >> 8) & 0xff] << 16) ^
+                ((uint32_t)sbox[t & 0xff] << 8) ^ sbox[t >> 24] ^ ((uint32_t)rcon << 24);
+            rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+        }
+        else if (nk == 8 && i % 8 == 4) {
+            t = ((uint32_t)sbox[t >> 24] << 24) ^ ((uint32_t)sbox[(t >> 16) & 0xff] << 16) ^
+                ((uint32_t)sbox[(t >> 8) & 0xff] << 8) ^ sbox[t & 0xff];
+        }
+        rk[i] = rk[i - nk] ^ t;
+    }
+
+    // Equivalent inverse cipher: reversed round keys,
+    // InvMixColumns applied to all but the first and last one
+    for (i = 0; i <= rounds; i++) {
+        for (j = 0; j < 4; j++) {
+            uint32_t t = rk[4 * (rounds - i) + j];
+            if (i > 0 && i < rounds) {
+                t = Td0[sbox[t >> 24]] ^ Td1[sbox[(t >> 16) & 0xff]] ^
+                    Td2[sbox[(t >> 8) & 0xff]] ^ Td3[sbox[t & 0xff]];
+            }
+            dk[4 * i + j] = t;
+        }
+    }
+
+    // AES-NI wants the round keys in byte order
+    ctx->engine = engine;
+    if (ctx->engine >= AES256_ENGINE_AESNI) {
+        for (i = 0; i < 4 * (rounds + 1); i++) {
+            uint32_t e = rk[i], d = dk[i];
+            PUTU32(ctx->enckey.bytes + 4 * i, e);
+            PUTU32(ctx->deckey.bytes + 4 * i, d);
+        }
+    }
+} /* aes256_init_key */
+
+/* -------------------------------------------------------------------------- */
+void aes256_init_ecb(aes256_context *ctx, uint8_t *k)
+{
+    aes256_init_key(ctx, k, AES_KEY_LENGTH);
+} /* aes256_init_ecb */
+
+/* -------------------------------------------------------------------------- */
+void aes256_done(aes256_context *ctx)
+{
+    volatile uint8_t *p = (volatile uint8_t *)ctx;
+    size_t i;
+
+    for (i = 0; i < sizeof(*ctx); i++) p[i] = 0;
+} /* aes256_done */
+
+#ifdef AES256_HAVE_AESNI
+/* -------------------------------------------------------------------------- */
+__attribute__ ((target("aes,sse2")))
+static void aesni_encrypt(const uint8_t *rk, int rounds, uint8_t *buf)
+{
+    const __m128i *k = (const __m128i *)rk;
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i *)buf), _mm_loadu_si128(k));
+
+    for (int i = 1; i < rounds; i++) b = _mm_aesenc_si128(b, _mm_loadu_si128(k + i));
+    b = _mm_aesenclast_si128(b, _mm_loadu_si128(k + rounds));
+    _mm_storeu_si128((__m128i *)buf, b);
+} /* aesni_encrypt */
+
+/* -------------------------------------------------------------------------- */
+__attribute__ ((target("aes,sse2")))
+static void aesni_decrypt(const uint8_t *rk, int rounds, uint8_t *buf)
+{
+    const __m128i *k = (const __m128i *)rk;
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i *)buf), _mm_loadu_si128(k));
+
+    for (int i = 1; i < rounds; i++) b = _mm_aesdec_si128(b, _mm_loadu_si128(k + i));
+    b = _mm_aesdeclast_si128(b, _mm_loadu_si128(k + rounds));
+    _mm_storeu_si128((__m128i *)buf, b);
+} /* aesni_decrypt */
+#endif
+
+/* -------------------------------------------------------------------------- */
+void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf)
+{
+#ifdef AES256_HAVE_AESNI
+    if (ctx->engine >= AES256_ENGINE_AESNI) {
+        aesni_encrypt(ctx->enckey.bytes, ctx->rounds, buf);
+        return;
+    }
+#endif
+    const uint32_t *rk = ctx->enckey.words;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = GETU32(buf     ) ^ rk[0];
+    s1 = GETU32(buf +  4) ^ rk[1];
+    s2 = GETU32(buf +  8) ^ rk[2];
+    s3 = GETU32(buf + 12) ^ rk[3];
+
+    for (r = 1; r < ctx->rounds; r++) {
+        rk += 4;
+        t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ rk[0];
+        t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ rk[1];
+        t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ rk[2];
+        t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    // Last round without MixColumns
+    rk += 4;
+    t0 = ((uint32_t)sbox[s0 >> 24] << 24) ^ ((uint32_t)sbox[(s1 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sbox[(s2 >> 8) & 0xff] << 8) ^ sbox[s3 & 0xff] ^ rk[0];
+    t1 = ((uint32_t)sbox[s1 >> 24] << 24) ^ ((uint32_t)sbox[(s2 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sbox[(s3 >> 8) & 0xff] << 8) ^ sbox[s0 & 0xff] ^ rk[1];
+    t2 = ((uint32_t)sbox[s2 >> 24] << 24) ^ ((uint32_t)sbox[(s3 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sbox[(s0 >> 8) & 0xff] << 8) ^ sbox[s1 & 0xff] ^ rk[2];
+    t3 = ((uint32_t)sbox[s3 >> 24] << 24) ^ ((uint32_t)sbox[(s0 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sbox[(s1 >> 8) & 0xff] << 8) ^ sbox[s2 & 0xff] ^ rk[3];
+    PUTU32(buf     , t0);
+    PUTU32(buf +  4, t1);
+    PUTU32(buf +  8, t2);
+    PUTU32(buf + 12, t3);
+} /* aes256_encrypt */
+
+/* -------------------------------------------------------------------------- */
+void aes256_decrypt_ecb(aes256_context *ctx, uint8_t *buf)
+{
+#ifdef AES256_HAVE_AESNI
+    if (ctx->engine >= AES256_ENGINE_AESNI) {
+        aesni_decrypt(ctx->deckey.bytes, ctx->rounds, buf);
+        return;
+    }
+#endif
+    const uint32_t *rk = ctx->deckey.words;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = GETU32(buf     ) ^ rk[0];
+    s1 = GETU32(buf +  4) ^ rk[1];
+    s2 = GETU32(buf +  8) ^ rk[2];
+    s3 = GETU32(buf + 12) ^ rk[3];
+
+    for (r = 1; r < ctx->rounds; r++) {
+        rk += 4;
+        t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >> 8) & 0xff] ^ Td3[s1 & 0xff] ^ rk[0];
+        t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xff] ^ Td2[(s3 >> 8) & 0xff] ^ Td3[s2 & 0xff] ^ rk[1];
+        t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xff] ^ Td2[(s0 >> 8) & 0xff] ^ Td3[s3 & 0xff] ^ rk[2];
+        t3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xff] ^ Td2[(s1 >> 8) & 0xff] ^ Td3[s0 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    // Last round without InvMixColumns
+    rk += 4;
+    t0 = ((uint32_t)sboxinv[s0 >> 24] << 24) ^ ((uint32_t)sboxinv[(s3 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sboxinv[(s2 >> 8) & 0xff] << 8) ^ sboxinv[s1 & 0xff] ^ rk[0];
+    t1 = ((uint32_t)sboxinv[s1 >> 24] << 24) ^ ((uint32_t)sboxinv[(s0 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sboxinv[(s3 >> 8) & 0xff] << 8) ^ sboxinv[s2 & 0xff] ^ rk[1];
+    t2 = ((uint32_t)sboxinv[s2 >> 24] << 24) ^ ((uint32_t)sboxinv[(s1 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sboxinv[(s0 >> 8) & 0xff] << 8) ^ sboxinv[s3 & 0xff] ^ rk[2];
+    t3 = ((uint32_t)sboxinv[s3 >> 24] << 24) ^ ((uint32_t)sboxinv[(s2 >> 16) & 0xff] << 16) ^
+         ((uint32_t)sboxinv[(s1 >> 8) & 0xff] << 8) ^ sboxinv[s0 & 0xff] ^ rk[3];
+    PUTU32(buf     , t0);
+    PUTU32(buf +  4, t1);
+    PUTU32(buf +  8, t2);
+    PUTU32(buf + 12, t3);
+} /* aes256_decrypt */
+
+#ifdef AES256_HAVE_AESNI
+/* -------------------------------------------------------------------------- */
+__attribute__ ((target("aes,sse2")))
+static void aesni_cbcmac_x8(const uint8_t *rk, int rounds, uint8_t *data[8], const size_t dataLen)
+{
+    const __m128i *kp = (const __m128i *)rk;
+    __m128i k[15], s[8];
+    int i, j;
+
+    for (i = 0; i <= rounds; i++) k[i] = _mm_loadu_si128(kp + i);
+    for (j = 0; j < 8; j++) s[j] = _mm_setzero_si128();
+
+    // Eight independent chains, so every aesenc has seven others to hide its latency
+    for (size_t n = 0; n < dataLen; n += AES256_CBC_LENGTH) {
+        for (j = 0; j < 8; j++) {
+            s[j] = _mm_xor_si128(_mm_xor_si128(s[j], _mm_loadu_si128((__m128i *)(data[j] + n))), k[0]);
+        }
+        for (i = 1; i < rounds; i++) {
+            for (j = 0; j < 8; j++) s[j] = _mm_aesenc_si128(s[j], k[i]);
+        }
+        for (j = 0; j < 8; j++) s[j] = _mm_aesenclast_si128(s[j], k[rounds]);
+    }
+    for (j = 0; j < 8; j++) _mm_storeu_si128((__m128i *)(data[j] + dataLen), s[j]);
+} /* aesni_cbcmac_x8 */
+
+/* -------------------------------------------------------------------------- */
+__attribute__ ((target("vaes,avx2,aes")))
+static void vaes_cbcmac_x16(const uint8_t *rk, int rounds, uint8_t *data[16], const size_t dataLen)
+{
+    const __m128i *kp = (const __m128i *)rk;
+    __m256i k[15], s[8];
+    int i, j;
+
+    for (i = 0; i <= rounds; i++) k[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128(kp + i));
+    for (j = 0; j < 8; j++) s[j] = _mm256_setzero_si256();
+
+    // Two pages per register, eight registers
+    for (size_t n = 0; n < dataLen; n += AES256_CBC_LENGTH) {
+        for (j = 0; j < 8; j++) {
+            __m256i b = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((__m128i *)(data[2 * j] + n))),
+                _mm_loadu_si128((__m128i *)(data[2 * j + 1] + n)), 1);
+            s[j] = _mm256_xor_si256(_mm256_xor_si256(s[j], b), k[0]);
+        }
+        for (i = 1; i < rounds; i++) {
+            for (j = 0; j < 8; j++) s[j] = _mm256_aesenc_epi128(s[j], k[i]);
+        }
+        for (j = 0; j < 8; j++) s[j] = _mm256_aesenclast_epi128(s[j], k[rounds]);
+    }
+    for (j = 0; j < 8; j++) {
+        _mm_storeu_si128((__m128i *)(data[2 * j] + dataLen), _mm256_castsi256_si128(s[j]));
+        _mm_storeu_si128((__m128i *)(data[2 * j + 1] + dataLen), _mm256_extracti128_si256(s[j], 1));
+    }
+} /* vaes_cbcmac_x16 */
+#endif
+
+/*! \fn     void aes256CbcMacCalculateMulti(aes256_ctx_t* ctx, uint8_t* data[], const size_t count, const size_t dataLen)
+*   \brief  Calculate the CBC-MAC of several buffers and save it at the end of each buffer.
+*   \note   Same result as aes256CbcMacCalculate() on every buffer. With AES-NI the
+*           buffers are processed in 8 (VAES: 16) interleaved lanes.
+*
+*   \param  ctx - context
+*   \param  data - array of pointers to the data, with space for the CBC-MAC at the end
+*   \param  count - number of buffers
+*   \param  dataLen - size of each buffer (excluding the CBC-MAC)
+*/
+void aes256CbcMacCalculateMulti(aes256_ctx_t* ctx, uint8_t* data[], const size_t count, const size_t dataLen)
+{
+    size_t i = 0;
+
+    // Check if dataLen is a multiple of AES256_CBC_LENGTH
+    if (dataLen % AES256_CBC_LENGTH != 0)
+    {
+        return;
+    }
+
+#ifdef AES256_HAVE_AESNI
+    // Unused lanes of the last group work on a scratch copy of the first buffer
+    uint8_t scratch[16][dataLen + AES256_CBC_LENGTH];
+    uint8_t* lanes[16];
+    int width = (ctx->engine == AES256_ENGINE_VAES) ? 16 : 8;
+
+    while (ctx->engine >= AES256_ENGINE_AESNI && i < count)
+    {
+        int used = (count - i < (size_t)width) ? (int)(count - i) : width;
+        for (int j = 0; j < width; j++)
+        {
+            if (j < used)
+            {
+                lanes[j] = data[i + j];
+            }
+            else
+            {
+                memcpy(scratch[j], data[i], dataLen);
+                lanes[j] = scratch[j];
+            }
+        }
+        if (width == 16)
+        {
+            vaes_cbcmac_x16(ctx->enckey.bytes, ctx->rounds, lanes, dataLen);
+        }
+        else
+        {
+            aesni_cbcmac_x8(ctx->enckey.bytes, ctx->rounds, lanes, dataLen);
+        }
+        i += used;
+    }
+#endif
+
+    // T-table engine, one buffer after the other
+    for (; i < count; i++)
+    {
+        aes256CbcMacCalculate(ctx, data[i], dataLen);
+    }
+} /* aes256CbcMacCalculateMulti */
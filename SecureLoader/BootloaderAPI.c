@@ -44,6 +44,12 @@ bool BootloaderAPI_EraseFillWritePage(const address_size_t address, const uint16
         return true;
     }
 
+    // Skip identical pages
+    if (BootloaderAPI_ComparePage(address, (const uint8_t*)words) == PAGE_IDENTICAL)
+    {
+        return false;
+    }
+
     // Erase the given FLASH page, ready to be programmed
     boot_page_erase(address);
     boot_spm_busy_wait();
@@ -55,10 +55,15 @@
             #define setPageAddress(address) (address)
         #endif
 
+        /* What BootloaderAPI_ComparePage() found about the new page data */
+        #define PAGE_IDENTICAL      0 // Nothing to do
+        #define PAGE_ERASE_WRITE    1 // Every write needs an erase first
+
     /* Function Prototypes: */
         bool BootloaderAPI_EraseFillWritePage(const address_size_t address, const uint16_t* words) __attribute__ ((used, section (".apitable_functions")));
         uint8_t BootloaderAPI_ReadByte(const address_size_t address) __attribute__ ((used, section (".apitable_functions")));
         static inline bool BootloaderAPI_ReadPage(const address_size_t Address, uint8_t* data);
+        static inline uint8_t BootloaderAPI_ComparePage(const address_size_t Address, const uint8_t* data);
         static inline void BootloaderAPI_WriteEEPROM(uint8_t* data, void* Address, uint8_t length);
         static inline void BootloaderAPI_UpdateEEPROM(uint8_t* data, void* Address, uint8_t length);
 
@@ -78,6 +83,18 @@
             return false;
         }
 
+        uint8_t BootloaderAPI_ComparePage(const address_size_t Address, const uint8_t* data)
+        {
+            // The datasheet requires an erase before every page write
+            for(uint16_t i = 0; i < SPM_PAGESIZE; i++){
+                if (data[i] != pgm_read_byte_auto(Address + i)) {
+                    return PAGE_ERASE_WRITE;
+                }
+            }
+
+            return PAGE_IDENTICAL;
+        }
+
         void BootloaderAPI_WriteEEPROM(uint8_t* data, void* Address, uint8_t length)
         {
             // Write data (max 8 bit length) and wait for eeprom to finish
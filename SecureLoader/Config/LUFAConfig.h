@@ -44,8 +44,21 @@
 
         /* USB Device Mode Driver Related Tokens: */
         #define FIXED_NUM_CONFIGURATIONS	1
-        #define FIXED_NUM_ENDPOINTS         1 // Excluding EP0
+#if defined(VENDOR_BULK_INTERFACE)
+        #define FIXED_NUM_ENDPOINTS         4 // Excluding EP0
+#else
+        #define FIXED_NUM_ENDPOINTS         2 // Excluding EP0
+#endif
 //        #define CONTROL_ONLY_DEVICE
 //        #define INTERRUPT_CONTROL_ENDPOINT
 
+        /* Timing Measurement Tokens: */
+        // -DTIMING_PIN=<bit> toggles that PORTB pin at the timing points of the bootloader,
+        // to be measured with a logic analyzer against /RESET. The first toggle drives it high.
+#if defined(TIMING_PIN)
+        #define TIMING_PIN_TOGGLE()         do { DDRB |= (1 << TIMING_PIN); PINB = (1 << TIMING_PIN); } while (0)
+#else
+        #define TIMING_PIN_TOGGLE()         do { } while (0)
+#endif
+
 #endif
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ihex.h"
+
+#define SPM_PAGESIZE 128
+#include "../AES/aes256_cbc.h"
+#include "../Protocol.h"
+
+// Size of the generated test image and bytes per hex record
+#define BENCH_IMAGE_SIZE (60 * 1024)
+#define BENCH_RECORD_SIZE 16
+#define BENCH_ITERATIONS 200
+#define BENCH_PAGESIZE 128
+#define BENCH_SIGN_PAGES 4096
+
+// Flat image size of the previous parser
+#define LEGACY_MEMORY_SIZE 0x10000
+
+static double timestamp(void);
+/****************************************************************/
+/*                                                              */
+/*                    Page Signing Benchmark                    */
+/*                                                              */
+/****************************************************************/
+
+#if defined(AES256_HOST)
+static void benchmark_cbcmac(int iterations)
+{
+    static const char* engine_names[] = { "T-table", "AES-NI", "VAES" };
+    static ProgrammFlashPage_t pages[BENCH_SIGN_PAGES];
+    static uint8_t* data[BENCH_SIGN_PAGES];
+    static uint8_t macs[BENCH_SIGN_PAGES][AES256_CBC_LENGTH];
+    const size_t len = sizeof(pages[0].PageDataBytes) + sizeof(pages[0].padding);
+    uint8_t key[32];
+    int i, rounds = iterations / 20 + 1;
+
+    srand(2);
+    for (i = 0; i < (int)sizeof(key); i++) key[i] = rand();
+    for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+        memset(pages[i].raw, 0, sizeof(pages[i]));
+        pages[i].PageAddress = i * SPM_PAGESIZE;
+        for (int j = 0; j < SPM_PAGESIZE; j++) pages[i].PageDataBytes[j] = rand();
+        data[i] = pages[i].raw;
+    }
+
+    printf("CBC-MAC: %d pages of %d bytes, %d rounds\n", BENCH_SIGN_PAGES, (int)len, rounds);
+    int best = aes256_get_engine();
+    for (int engine = AES256_ENGINE_TTABLE; engine <= best; engine++) {
+        aes256_ctx_t ctx;
+        aes256_set_engine(engine);
+        aes256_init(key, &ctx);
+
+        // One page after the other, like writeData() used to do
+        double begin = timestamp();
+        for (int r = 0; r < rounds; r++) {
+            for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+                aes256CbcMacCalculate(&ctx, pages[i].raw, len);
+            }
+        }
+        double single_time = timestamp() - begin;
+        for (i = 0; i < BENCH_SIGN_PAGES; i++) memcpy(macs[i], pages[i].cbcMac, AES256_CBC_LENGTH);
+
+        // All pages through the multi-buffer kernel
+        begin = timestamp();
+        for (int r = 0; r < rounds; r++) {
+            aes256CbcMacCalculateMulti(&ctx, data, BENCH_SIGN_PAGES, len);
+        }
+        double multi_time = timestamp() - begin;
+
+        int match = 1;
+        for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+            if (memcmp(macs[i], pages[i].cbcMac, AES256_CBC_LENGTH)) match = 0;
+        }
+
+        double n = (double)BENCH_SIGN_PAGES * rounds;
+        printf("  %-8s single: %10.0f pages/s, multi: %10.0f pages/s (%.1fx), MACs %s\n",
+            engine_names[engine], n / single_time, n / multi_time, single_time / multi_time,
+            match ? "match" : "DIFFER");
+    }
+    aes256_set_engine(best);
+}
+#else
+// aes.c as the device uses it, built by the bench-device target with and
+// without AES256_KEY_SCHEDULE. Only the ratio is meaningful, the AVR was
+// not measured yet (see AES/README.md).
+static void benchmark_device_aes(int iterations)
+{
+    static ProgrammFlashPage_t pages[BENCH_SIGN_PAGES];
+    static uint8_t macs[BENCH_SIGN_PAGES][AES256_CBC_LENGTH];
+    const size_t len = sizeof(pages[0].PageDataBytes) + sizeof(pages[0].padding);
+    uint8_t key[32];
+    int i, errors = 0, rounds = iterations / 200 + 1;
+    aes256_ctx_t ctx;
+
+    srand(2);
+    for (i = 0; i < (int)sizeof(key); i++) key[i] = rand();
+    for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+        memset(pages[i].raw, 0, sizeof(pages[i]));
+        pages[i].PageAddress = i * SPM_PAGESIZE;
+        for (int j = 0; j < SPM_PAGESIZE; j++) pages[i].PageDataBytes[j] = rand();
+    }
+
+#if defined(AES256_KEY_SCHEDULE)
+    const char* name = "cached key schedule";
+#else
+    const char* name = "keys on the fly";
+#endif
+    printf("Device AES, %s: %d bytes context, %d pages of %d bytes, %d rounds\n",
+        name, (int)sizeof(ctx), BENCH_SIGN_PAGES, (int)len, rounds);
+
+    double begin = timestamp();
+    for (int r = 0; r < rounds; r++) {
+        aes256_init(key, &ctx);
+    }
+    double init_time = timestamp() - begin;
+
+    // Page MAC like the device checks it (aes256_enc)
+    begin = timestamp();
+    for (int r = 0; r < rounds; r++) {
+        for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+            aes256CbcMacCalculate(&ctx, pages[i].raw, len);
+        }
+    }
+    double enc_time = timestamp() - begin;
+    for (i = 0; i < BENCH_SIGN_PAGES; i++) memcpy(macs[i], pages[i].cbcMac, AES256_CBC_LENGTH);
+
+    // Reverse check of the same MACs (aes256_dec), like the newKey and authenticate
+    // requests. The check overwrites the MAC, so it is restored every time.
+    begin = timestamp();
+    for (int r = 0; r < rounds; r++) {
+        for (i = 0; i < BENCH_SIGN_PAGES; i++) {
+            memcpy(pages[i].cbcMac, macs[i], AES256_CBC_LENGTH);
+            errors += aes256CbcMacReverseCompare(&ctx, pages[i].raw, len);
+        }
+    }
+    double dec_time = timestamp() - begin;
+
+    double n = (double)BENCH_SIGN_PAGES * rounds;
+    printf("  init: %8.2f us, MAC: %10.0f pages/s, reverse MAC: %10.0f pages/s, MACs %s\n",
+        init_time * 1e6 / rounds, n / enc_time, n / dec_time, errors ? "DIFFER" : "match");
+}
+#endif
+
+static int write_test_file(const char *filename);
+static int legacy_read_intel_hex(const char *filename);
+static void benchmark_ihex(const char *filename, int iterations);
+#if defined(AES256_HOST)
+static void benchmark_cbcmac(int iterations);
+#else
+static void benchmark_device_aes(int iterations);
+#endif
+
+int main(int argc, char **argv)
+{
+    const char *filename = "SecureLoaderBench.hex";
+    int iterations = BENCH_ITERATIONS;
+
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) iterations = BENCH_ITERATIONS;
+
+    if (write_test_file(filename) < 0) {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        return 1;
+    }
+    benchmark_ihex(filename, iterations);
+    remove(filename);
+#if defined(AES256_HOST)
+    benchmark_cbcmac(iterations);
+#else
+    benchmark_device_aes(iterations);
+#endif
+    return 0;
+}
+
+/****************************************************************/
+/*                                                              */
+/*                   Intel Hex Parser Benchmark                 */
+/*                                                              */
+/****************************************************************/
+
+static unsigned char legacy_image[LEGACY_MEMORY_SIZE];
+static unsigned char legacy_mask[LEGACY_MEMORY_SIZE];
+
+static void benchmark_ihex(const char *filename, int iterations)
+{
+    FILE *fp = fopen(filename, "rb");
+    long size = 0;
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+
+    int i, legacy_count = 0, count = 0;
+    double begin, legacy_time, fast_time;
+
+    begin = timestamp();
+    for (i = 0; i < iterations; i++) {
+        legacy_count = legacy_read_intel_hex(filename);
+    }
+    legacy_time = timestamp() - begin;
+
+    // ihex_load_file() is used directly, read_intel_hex() would only parse once
+    begin = timestamp();
+    for (i = 0; i < iterations; i++) {
+        count = ihex_load_file(filename);
+    }
+    fast_time = timestamp() - begin;
+
+    // Both parsers have to produce the same image
+    unsigned char image[LEGACY_MEMORY_SIZE];
+    ihex_get_data(0, LEGACY_MEMORY_SIZE - 1, image);
+    int match = (count == legacy_count);
+    for (i = 0; i < LEGACY_MEMORY_SIZE - 1; i++) {
+        unsigned char legacy = legacy_mask[i] ? legacy_image[i] : 255;
+        if (image[i] != legacy) match = 0;
+        if (ihex_bytes_within_range(i, i) != legacy_mask[i]) match = 0;
+    }
+
+    // Page occupancy lookups, byte mask scan against the page bitmap
+    int pages = 0, legacy_pages = 0;
+    begin = timestamp();
+    for (i = 0; i < iterations; i++) {
+        for (int addr = 0; addr < LEGACY_MEMORY_SIZE; addr += BENCH_PAGESIZE) {
+            for (int j = addr; j < addr + BENCH_PAGESIZE; j++) {
+                if (legacy_mask[j]) {
+                    legacy_pages++;
+                    break;
+                }
+            }
+        }
+    }
+    double legacy_query_time = timestamp() - begin;
+
+    ihex_set_page_size(BENCH_PAGESIZE);
+    begin = timestamp();
+    for (i = 0; i < iterations; i++) {
+        for (int addr = 0; addr < LEGACY_MEMORY_SIZE; addr += BENCH_PAGESIZE) {
+            pages += ihex_page_used(addr);
+        }
+    }
+    double query_time = timestamp() - begin;
+    if (pages != legacy_pages) match = 0;
+
+    double mb = (double)size * iterations / (1024.0 * 1024.0);
+    printf("Intel hex: %ld bytes, %d data bytes, %d iterations\n", size, count, iterations);
+    printf("  sscanf parser: %8.3f s, %8.1f MB/s\n", legacy_time, mb / legacy_time);
+    printf("  table parser:  %8.3f s, %8.1f MB/s (%.1fx)\n", fast_time, mb / fast_time,
+        legacy_time / fast_time);
+    printf("  page lookups:  %8.3f ms mask scan, %8.3f ms bitmap\n", legacy_query_time * 1000.0, query_time * 1000.0);
+    printf("  images %s\n", match ? "match" : "DIFFER");
+}
+
+static int write_test_file(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    int addr, i;
+
+    if (fp == NULL) return -1;
+    srand(1);
+    fprintf(fp, ":020000040000FA\n");
+    for (addr = 0; addr < BENCH_IMAGE_SIZE; addr += BENCH_RECORD_SIZE) {
+        int sum = BENCH_RECORD_SIZE + (addr >> 8) + (addr & 255);
+        fprintf(fp, ":%02X%04X00", BENCH_RECORD_SIZE, addr);
+        for (i = 0; i < BENCH_RECORD_SIZE; i++) {
+            int b = rand() & 255;
+            sum += b;
+            fprintf(fp, "%02X", b);
+        }
+        fprintf(fp, "%02X\n", -sum & 255);
+    }
+    fprintf(fp, ":00000001FF\n");
+    return fclose(fp) ? -1 : 0;
+}
+
+/****************************************************************/
+/*                                                              */
+/*                  Legacy sscanf Hex Parser                    */
+/*                                                              */
+/****************************************************************/
+
+// Copy of the previous SecureLoaderCli parser, kept as reference
+static int end_record_seen=0;
+static int byte_count;
+static unsigned int extended_addr = 0;
+static int legacy_parse_hex_line(char *line);
+
+static int legacy_read_intel_hex(const char *filename)
+{
+    FILE *fp;
+    int i;
+    char buf[1024];
+
+    byte_count = 0;
+    end_record_seen = 0;
+    for (i=0; i<LEGACY_MEMORY_SIZE; i++) {
+        legacy_image[i] = 0xFF;
+        legacy_mask[i] = 0;
+    }
+    extended_addr = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (!feof(fp)) {
+        *buf = '\0';
+        if (!fgets(buf, sizeof(buf), fp)) break;
+        if (*buf) {
+            if (legacy_parse_hex_line(buf) == 0) {
+                fclose(fp);
+                return -2;
+            }
+        }
+        if (end_record_seen) break;
+    }
+    fclose(fp);
+    return byte_count;
+}
+
+static int legacy_parse_hex_line(char *line)
+{
+    int addr, code, num;
+    int sum, len, cksum, i;
+    char *ptr;
+
+    num = 0;
+    if (line[0] != ':') return 0;
+    if (strlen(line) < 11) return 0;
+    ptr = line+1;
+    if (!sscanf(ptr, "%02x", &len)) return 0;
+    ptr += 2;
+    if ((int)strlen(line) < (11 + (len * 2)) ) return 0;
+    if (!sscanf(ptr, "%04x", &addr)) return 0;
+    ptr += 4;
+    if (!sscanf(ptr, "%02x", &code)) return 0;
+    if (addr + extended_addr + len >= LEGACY_MEMORY_SIZE) return 0;
+    ptr += 2;
+    sum = (len & 255) + ((addr >> 8) & 255) + (addr & 255) + (code & 255);
+    if (code != 0) {
+        if (code == 1) {
+            end_record_seen = 1;
+            return 1;
+        }
+        if (code == 2 && len == 2) {
+            if (!sscanf(ptr, "%04x", &i)) return 1;
+            ptr += 4;
+            sum += ((i >> 8) & 255) + (i & 255);
+            if (!sscanf(ptr, "%02x", &cksum)) return 1;
+            if (((sum & 255) + (cksum & 255)) & 255) return 1;
+            extended_addr = i << 4;
+        }
+        if (code == 4 && len == 2) {
+            if (!sscanf(ptr, "%04x", &i)) return 1;
+            ptr += 4;
+            sum += ((i >> 8) & 255) + (i & 255);
+            if (!sscanf(ptr, "%02x", &cksum)) return 1;
+            if (((sum & 255) + (cksum & 255)) & 255) return 1;
+            extended_addr = i << 16;
+        }
+        return 1;    // non-data line
+    }
+    byte_count += len;
+    while (num != len) {
+        if (sscanf(ptr, "%02x", &i) != 1) return 0;
+        i &= 255;
+        legacy_image[addr + extended_addr + num] = i;
+        legacy_mask[addr + extended_addr + num] = 1;
+        ptr += 2;
+        sum += i;
+        (num)++;
+        if (num >= 256) return 0;
+    }
+    if (!sscanf(ptr, "%02x", &cksum)) return 0;
+    if (((sum & 255) + (cksum & 255)) & 255) return 0; /* checksum error */
+    return 1;
+}
+
+/****************************************************************/
+/*                                                              */
+/*                       Misc Functions                         */
+/*                                                              */
+/****************************************************************/
+
+static double timestamp(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
@@ -1,9 +1,38 @@
 
+// Defaults for the ATmega32u4, override them for other MCUs,
+// e.g. -DSPM_PAGESIZE=256 -DCODE_SIZE=0x20000 -DBOOTLOADER_SIZE=0x2000 for the AT90USB1286
+#ifndef SPM_PAGESIZE
 #define SPM_PAGESIZE 128
+#endif
 #define VENDOR_ID 0x7777
 #define PRODUCT_ID 0x7777
+#ifndef CODE_SIZE
 #define CODE_SIZE (32 * 1024)
+#endif
+#ifndef BOOTLOADER_SIZE
 #define BOOTLOADER_SIZE (4 * 1024)
+#endif
+
+// Default number of queued page transfers in pipelined mode
+#define PIPELINE_DEPTH 4
+
+// Number of pages that are signed together in one multi-buffer CBC-MAC call
+#define SIGN_BATCH 16
+
+// Largest control transfer all backends can send, limits the ProgrammFlashPages size
+#define BATCH_REPORT_MAX 1024
+
+// Report size of the HID OUT and IN endpoints
+#define HID_REPORT_SIZE 64
+
+// Endpoints the flash pages can be sent to
+#define PIPE_CONTROL   0
+#define PIPE_INTERRUPT 1
+#define PIPE_BULK      2
+
+// Maximum number of devices and device path length in fleet mode
+#define FLEET_MAX_DEVICES 64
+#define SECURELOADER_PATH_MAX 256
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,14 +40,95 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 #include "../AES/aes256_cbc.h"
 #include "../Protocol.h"
+#include "ihex.h"
 
 // Bootloader API
 void authenticate(uint8_t* signkey);
-void writeData(uint8_t* signkey);
+void signAuthenticate(uint8_t* signkey, const uint8_t* challenge, uint8_t* request);
+void sendAuthenticate(const uint8_t* request, const uint8_t* challenge);
+int writeData(uint8_t* signkey);
+void writePages(ProgrammFlashPage_t* batch, int count, int batchPages, int pipe, int compress, double* signtime);
+int readCapabilities(BootloaderCapabilities_t* capabilities);
+int readKeyLength(void);
+void readProgrammStatus(int pipe, double timeout);
 void changeKey(uint8_t* oldkey, uint8_t* newkey);
+void signChangeKey(uint8_t* oldkey, uint8_t* newkey, uint8_t* request);
 void verifyData(void);
+void verifyPages(void);
+void verifyPage(uint16_t PageAddress, const uint8_t* data);
+int verifyDigest(const FlashDigest_t* expected);
+int readPageChecksums(uint16_t* checksums);
+int readVerifyStatus(int pages);
+
+// Number of application pages, the size of a readPageChecksums() table
+#define APPLICATION_PAGES ((CODE_SIZE - BOOTLOADER_SIZE) / SPM_PAGESIZE)
+
+// Signed requests without the IV that is only used for encryption
+#define AUTHENTICATE_REQUEST_SIZE (2 * AES256_CBC_LENGTH)
+#define CHANGEKEY_REQUEST_SIZE (32 + AES256_CBC_LENGTH)
+
+// Firmware Package Functions
+int signFirmware(void);
+int signBatch(void);
+void deriveKey(const uint8_t* masterkey, const char* serial, uint8_t* devkey);
+int collectPages(ProgrammFlashPage_t** pages);
+uint8_t* buildPackage(const ProgrammFlashPage_t* pages, int count, uint8_t* signkey, uint8_t* newkey, size_t* size);
+int package_open(const char *path);
+void package_close(void);
+int writePackage(uint8_t* signkey, uint8_t* newkey);
+void verifyPackage(void);
+
+// A package contains the ready to send requests for one device, so the
+// flashing station needs neither the hex file nor the Bootloader Key.
+// Layout: header, index, records. Values are little endian and every
+// record starts at a multiple of 16 bytes.
+#define PACKAGE_MAGIC "SLPK"
+#define PACKAGE_VERSION 1
+#define PACKAGE_ALIGN(x) (((x) + 15) & ~(size_t)15)
+
+typedef enum {
+    PACKAGE_AUTHENTICATE = 1,   // authenticate request, followed by the expected challenge
+    PACKAGE_CHANGEKEY = 2,      // newBootloaderKey request
+    PACKAGE_PAGE = 3,           // ProgrammFlashPage_t
+    PACKAGE_DIGEST = 4,         // FlashDigest_t expected after programming
+} package_record_type_t;
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t pagesize;
+    uint32_t records;
+    uint32_t size;
+    uint8_t keylength;          // Bootloader Key in bytes, 0 for 32
+    uint8_t reserved[15];
+} package_header_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t offset;
+    uint32_t length;
+} package_index_t;
+
+// Package that is used by the flash command
+static struct {
+    uint8_t* data;
+    size_t size;
+    const package_header_t* header;
+    const package_index_t* index;
+    int pages;
+    bool mapped;
+} package;
 
 // USB Access Functions
 void SecureLoader_init(void);
@@ -26,18 +136,34 @@ void SecureLoader_exit(void);
 int SecureLoader_open(void);
 int SecureLoader_write(void *buf, int len, double timeout);
 int SecureLoader_read(void *buf, int len, double timeout);
+int SecureLoader_async_supported(void);
+int SecureLoader_write_async(void *buf, int len, double timeout);
+int SecureLoader_flush(double timeout);
+int SecureLoader_interrupt_supported(void);
+int SecureLoader_write_interrupt(void *buf, int len, double timeout);
+int SecureLoader_read_interrupt(void *buf, int len, double timeout);
+int SecureLoader_bulk_supported(void);
+int SecureLoader_write_bulk(void *buf, int len, double timeout);
+int SecureLoader_read_bulk(void *buf, int len, double timeout);
 void SecureLoader_close(void);
+int SecureLoader_enumerate(char paths[][SECURELOADER_PATH_MAX], int max);
+int SecureLoader_open_path(const char *path);
 
-// Intel Hex File Functions
-int read_intel_hex(const char *filename);
-int ihex_bytes_within_range(int begin, int end);
-void ihex_get_data(int addr, int len, unsigned char *bytes);
+// Fleet Programming Functions
+void fleet_add_device(const char *path);
+int fleet_program(void);
 
 // Misc stuff
 int printf_verbose(const char *format, ...);
 int printf_high_verbose(const char *format, ...);
-void hexdump(uint8_t * data, size_t len);
+void hexdump(const uint8_t * data, size_t len);
 void delay(double seconds);
+double timestamp(void);
+void run_parallel(int count, int threads, void (*job)(void *arg, int index), void *arg);
+int parse_key(const char *hex, uint8_t *key);
+void random_bytes(uint8_t *buf, size_t len);
+uint16_t crc16(const uint8_t *data, size_t len);
+int compress_pages(const uint8_t *data, int pages, uint8_t *out);
 void die(const char *str, ...);
 void parse_options(int argc, char **argv);
 
@@ -45,11 +171,41 @@ void parse_options(int argc, char **argv);
 int wait_for_device_to_appear = 0;
 int reboot_after_programming = 1;
 int verbose = 0;
+int pipeline_depth = 0;
+int delta_update = 0;
+int device_verify_only = 0;
+int control_transfers_only = 0;
+int hid_out_endpoint = 0;
+int fleet_all_devices = 0;
+int fleet_threads = 0;
+const char *fleet_keyfile = NULL;
+int fleet_count = 0;
+int key_bits = 256;
+int package_authenticate = 1;
+const char *command = NULL;
+const char *package_output = NULL;
+const char *sign_key = NULL;
+const char *new_key = NULL;
+const char *master_key = NULL;
+const char *serial_file = NULL;
 const char *filename=NULL;
 
 
-// AES
-aes256_ctx_t ctx;
+// AES, one context per thread for fleet programming
+__thread aes256_ctx_t ctx;
+
+// Bootloader Key size in bytes, read from the device by authenticate(), -b otherwise
+static __thread int key_length = 0;
+
+// Page the device reads next with ReadFlashPage_t, -1 if unknown
+static __thread int read_pointer = -1;
+static __thread int read_pointer_advances = 1;
+
+// Requests on the HID OUT or bulk OUT endpoint that were not answered yet
+static __thread int status_pending = 0;
+
+// Pages the last upload skipped by their CRC16, only a digest can prove them
+static __thread int skipped_pages = 0;
 
 static uint8_t key[32] = {
     0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
@@ -67,9 +223,40 @@ static uint8_t key2[32] = {
 
 void usage(void)
 {
-    fprintf(stderr, "Usage: hid_bootloader_cli [-w] [-h] [-n] [-v] <file.hex>\n");
+    fprintf(stderr, "Usage: hid_bootloader_cli [-w] [-h] [-n] [-p[N]] [-u] [-c] [-i] [-s] [-a] [-d <path>] [-k <keyfile>] [-j <threads>] [-v] <file.hex>\n");
+    fprintf(stderr, "       hid_bootloader_cli sign [-b <bits>] [-K <key>] [-N <key>] [-A] [-v] -o <package> <file.hex>\n");
+    fprintf(stderr, "       hid_bootloader_cli sign [-b <bits>] -k <keyfile> [-j <threads>] [-v] -o <directory> <file.hex>\n");
+    fprintf(stderr, "       hid_bootloader_cli sign [-b <bits>] -M <key> -S <serialfile> [-j <threads>] [-v] -o <directory> <file.hex>\n");
+    fprintf(stderr, "       hid_bootloader_cli flash [-w] [-n] [-p[N]] [-u] [-c] [-i] [-s] [-a] [-d <path>] [-j <threads>] [-K <key>] [-N <key>] [-v] <package>\n");
+    fprintf(stderr, "\tsign  : Write a package with signed requests for the hex file\n");
+    fprintf(stderr, "\tflash : Program a package, no key or hex file needed\n");
     fprintf(stderr, "\t-w  : Wait for device to appear\n");
     fprintf(stderr, "\t-n  : No reboot after programming\n");
+    fprintf(stderr, "\t-p  : Pipelined upload, keep N pages in flight (default %d), libusb-1.0 build only\n", PIPELINE_DEPTH);
+    fprintf(stderr, "\t-u  : Update, only write pages whose checksum differs on the device\n");
+    fprintf(stderr, "\t-c  : Send pages as control transfers, even if the device has a bulk OUT endpoint\n");
+    fprintf(stderr, "\t-i  : Send pages on the HID OUT endpoint if there is no bulk OUT endpoint\n");
+    fprintf(stderr, "\t-s  : Skip the verify pass if the device verified every page after writing it\n");
+    fprintf(stderr, "\t      With -u the whole image is still verified when pages were skipped\n");
+    fprintf(stderr, "\t-a  : Program all connected devices in parallel\n");
+    fprintf(stderr, "\t-d  : Program the device with this hidraw or USB port path, may be repeated\n");
+    fprintf(stderr, "\t-k  : Key file with \"<path> <hex key>\" lines for -a/-d, \"*\" matches any path\n");
+    fprintf(stderr, "\t      For sign: \"<name> <hex key>\" lines, one package <name>.slp per line\n");
+    fprintf(stderr, "\t-j  : Number of worker threads for -a/-d (default one per device)\n");
+    fprintf(stderr, "\t-o  : Output package for sign\n");
+    fprintf(stderr, "\t-b  : Key size of the devices for sign, 128 or 256 bit (default 256)\n");
+    fprintf(stderr, "\t      AES-128 devices use the first 32 hex digits of a 64 digit key\n");
+    fprintf(stderr, "\t-K  : Bootloader Key (64 or 32 hex digits) to sign the package with\n");
+    fprintf(stderr, "\t      For flash: authenticate the device live with this key, not with the package\n");
+    fprintf(stderr, "\t-N  : New Bootloader Key the package installs before programming\n");
+    fprintf(stderr, "\t      For flash: authenticate the device live with it after the key change\n");
+    fprintf(stderr, "\t-A  : No authentication in the package, the recorded challenge can be replayed\n");
+    fprintf(stderr, "\t-M  : Master key, the Bootloader Key of every device is derived from it and its serial\n");
+    fprintf(stderr, "\t-S  : Serial file with one device serial per line for -M\n");
+#if defined(USE_EMULATOR)
+    fprintf(stderr, "\t-E  : Emulator timing \"<latency>,<erase>,<write>\" in ms per transfer and page (default 1,4,4)\n");
+    fprintf(stderr, "\t      \",<fill>\" preloads the application flash with this byte instead of a blank device\n");
+#endif
     fprintf(stderr, "\t-v  : Verbose output\n");
     fprintf(stderr, "\t-vv : High verbose output\n");
     SecureLoader_exit();
@@ -97,13 +284,27 @@ int main(int argc, char **argv)
         usage();
     }
     printf_verbose("SecureLoader Loader, Command Line, Version 1.0\n");
+    ihex_set_page_size(SPM_PAGESIZE);
 
-    // Read the intel hex file
+    // Signing does not need a device
+    if (command && !strcmp(command, "sign")) {
+        int r = signFirmware();
+        SecureLoader_exit();
+        return r;
+    }
+
+    // Read the package or the intel hex file
     // This is done first so any error is reported before using USB
-    num = read_intel_hex(filename);
-    if (num < 0) die("Error reading Intel hex file \"%s\"", filename);
-    printf_verbose("Read \"%s\": %d bytes, %.1f%% usage\n",
-        filename, num, (double)num / (double)CODE_SIZE * 100.0);
+    if (command && !strcmp(command, "flash")) {
+        if (!package_open(filename)) die("Error reading package \"%s\"\n", filename);
+        printf_verbose("Read \"%s\": %d pages\n", filename, package.pages);
+    }
+    else {
+        num = read_intel_hex(filename);
+        if (num < 0) die("Error reading Intel hex file \"%s\"", filename);
+        printf_verbose("Read \"%s\": %d bytes, %.1f%% usage\n",
+            filename, num, (double)num / (double)CODE_SIZE * 100.0);
+    }
 
     // Open the USB device
     while (!SecureLoader_open()) {
@@ -118,27 +319,47 @@ int main(int argc, char **argv)
 
     // if we waited for the device, read the hex file again
     // perhaps it changed while we were waiting?
-    if (waited) {
+    if (waited && !package.data) {
         num = read_intel_hex(filename);
         if (num < 0) die("Error reading intel hex file \"%s\"", filename);
         printf_verbose("Read \"%s\": %d bytes, %.1f%% usage\n",
              filename, num, (double)num / (double)CODE_SIZE * 100.0);
     }
 
-    fflush(stdout);
+    // Program several devices in parallel. The workers open every device
+    // themselves, so release the one that was opened here.
+    if (fleet_all_devices || fleet_count) {
+        SecureLoader_close();
+        int r = fleet_program();
+        SecureLoader_exit();
+        return r;
+    }
 
-    // TODO verify via authentification package?
-    authenticate(key);
-    changeKey(key, key2);
-    authenticate(key2);
-    writeData(key2);
-    verifyData();
+    fflush(stdout);
 
-    authenticate(key2);
-    writeData(key2);
-    verifyData();
-    changeKey(key2, key);
-    authenticate(key);
+    // Everything needed is inside the package. With the keys at hand the
+    // device is authenticated live instead of with the recorded challenges.
+    if (package.data) {
+        uint8_t signkey[32], newkey[32];
+        if (sign_key && !parse_key(sign_key, signkey)) die("Invalid key \"%s\"\n", sign_key);
+        if (new_key && !parse_key(new_key, newkey)) die("Invalid key \"%s\"\n", new_key);
+        int pages = writePackage(sign_key ? signkey : NULL, new_key ? newkey : NULL);
+        if (!readVerifyStatus(pages) || !device_verify_only || skipped_pages) verifyPackage();
+    }
+    else {
+        // TODO verify via authentification package?
+        authenticate(key);
+        changeKey(key, key2);
+        authenticate(key2);
+        int pages = writeData(key2);
+        if (!readVerifyStatus(pages) || !device_verify_only || skipped_pages) verifyData();
+
+        authenticate(key2);
+        pages = writeData(key2);
+        if (!readVerifyStatus(pages) || !device_verify_only || skipped_pages) verifyData();
+        changeKey(key2, key);
+        authenticate(key);
+    }
 
     // reboot to the user's new code
     if (reboot_after_programming) {
@@ -148,6 +369,7 @@ int main(int argc, char **argv)
         if (!r) die("Error writing to SecureLoader\n");
     }
     SecureLoader_close();
+    package_close();
     SecureLoader_exit();
     return 0;
 }
@@ -156,21 +378,31 @@ void authenticate(uint8_t* signkey)
 {
     printf_verbose("Authenticating Secureloader\n");
 
-    // Get the data ready
-    authenticateBootloader_t authenticateBootloader;
+    // Every later request is signed for the key size of this device
+    key_length = readKeyLength();
+
+    // Get the data ready, the challenge must not be predictable
     uint8_t challenge[AES256_CBC_LENGTH];
-    for(int i = 0; i < sizeof(challenge); i++){
-        challenge[i] = rand();
-    }
+    random_bytes(challenge, sizeof(challenge));
     if(verbose > 1)
     {
         printf_high_verbose("Seed:\n");
         hexdump(challenge, sizeof(challenge));
     }
+
+    // Sign the challenge and check the answer of the AVR
+    uint8_t request[AUTHENTICATE_REQUEST_SIZE];
+    signAuthenticate(signkey, challenge, request);
+    sendAuthenticate(request, challenge);
+}
+
+void signAuthenticate(uint8_t* signkey, const uint8_t* challenge, uint8_t* request)
+{
+    authenticateBootloader_t authenticateBootloader;
     memcpy(authenticateBootloader.data.challenge, challenge, sizeof(authenticateBootloader.data.challenge));
 
     // Initialize key schedule inside CTX
-    aes256_init(signkey, &ctx);
+    aes256_init_key(&ctx, signkey, key_length ? key_length : key_bits / 8);
 
     // Encrypt the data
     aes256CbcEncrypt(&ctx, authenticateBootloader.IV, sizeof(authenticateBootloader.data.challenge));
@@ -178,30 +410,79 @@ void authenticate(uint8_t* signkey)
     // Calculate and save CBC-MAC
     aes256CbcMacCalculate(&ctx, authenticateBootloader.data.raw, sizeof(authenticateBootloader.data.challenge));
 
-    // Write data to the AVR
-    int r = SecureLoader_write(authenticateBootloader.data.raw, sizeof(authenticateBootloader.data), 1);
+    memcpy(request, authenticateBootloader.data.raw, sizeof(authenticateBootloader.data));
+}
+
+void sendAuthenticate(const uint8_t* request, const uint8_t* challenge)
+{
+    // Write data to the AVR. Right after a reset the device holds the first
+    // signed request until its brute force delay (1s) has run out.
+    int r = SecureLoader_write((void*)request, AUTHENTICATE_REQUEST_SIZE, 2);
     if (!r) die("Error writing to SecureLoader\n");
 
     // Get data from AVR
-    r = SecureLoader_read(authenticateBootloader.data.challenge, sizeof(authenticateBootloader.data.challenge), 1);
+    uint8_t answer[AES256_CBC_LENGTH];
+    r = SecureLoader_read(answer, sizeof(answer), 1);
     if (!r) die("Error reading SecureLoader\n");
 
     // Compare the data
-    if(memcmp(authenticateBootloader.data.challenge, challenge, sizeof(challenge))){
+    if(memcmp(answer, challenge, sizeof(answer))){
         printf_verbose("Expected:\n");
-        hexdump(challenge, sizeof(challenge));
+        hexdump(challenge, sizeof(answer));
         printf_verbose("Received:\n");
-        hexdump(authenticateBootloader.data.challenge, sizeof(authenticateBootloader.data.challenge));
+        hexdump(answer, sizeof(answer));
         die("Error authentification mismatch\n");
     }
 }
 
-void writeData(uint8_t* signkey)
+int writeData(uint8_t* signkey)
 {
     printf_verbose("Programming\n");
+
+    // Save key inside context, it is reused for every page
+    aes256_init_key(&ctx, signkey, key_length ? key_length : key_bits / 8);
+    status_pending = 0;
+
+    int pages = 0, batched = 0, unchanged = 0;
+    double signtime = 0;
+    double start = timestamp();
+    ProgrammFlashPage_t batch[SIGN_BATCH];
+
+    // Checksums of the pages that are already on the device
+    uint16_t checksums[APPLICATION_PAGES];
+    bool delta = delta_update && readPageChecksums(checksums);
+
+    // Largest batch of the device that every backend can send
+    BootloaderCapabilities_t capabilities;
+    readCapabilities(&capabilities);
+    int batchPages = capabilities.BatchPages;
+    if (PROGRAMM_FLASH_PAGES_LENGTH(batchPages) > BATCH_REPORT_MAX) {
+        batchPages = (BATCH_REPORT_MAX - PROGRAMM_FLASH_PAGES_LENGTH(0)) / SPM_PAGESIZE;
+    }
+    if (batchPages > SIGN_BATCH) batchPages = SIGN_BATCH;
+
+    // Stream the pages to the bulk endpoint if the device and the backend have it.
+    // The HID OUT endpoint is opt-in, one report per frame is slower than control transfers.
+    int pipe = PIPE_CONTROL;
+    if (control_transfers_only) {
+        pipe = PIPE_CONTROL;
+    }
+    else if ((capabilities.Features & CAPABILITY_VENDOR_BULK) && SecureLoader_bulk_supported()) {
+        pipe = PIPE_BULK;
+    }
+    else if (hid_out_endpoint && (capabilities.Features & CAPABILITY_HID_OUT_ENDPOINT) &&
+             SecureLoader_interrupt_supported()) {
+        pipe = PIPE_INTERRUPT;
+    }
+    static const char* const pipeNames[] = { "control endpoint", "HID OUT endpoint", "bulk OUT endpoint" };
+    printf_verbose("Writing up to %d pages per request to the %s\n", batchPages, pipeNames[pipe]);
+
+    // Compressed pages need the request length from the header block
+    int compress = (pipe != PIPE_CONTROL) && (capabilities.Features & CAPABILITY_COMPRESSED_PAGES);
+
     for (int addr = 0; addr < CODE_SIZE; addr += SPM_PAGESIZE) {
         printf_high_verbose("\n%d", addr);
-        if (addr > 0 && !ihex_bytes_within_range(addr, addr + SPM_PAGESIZE - 1)) {
+        if (addr > 0 && !ihex_page_used(addr)) {
             // don't waste time on blocks that are unused,
             // but always do the first one to erase the chip
             printf_high_verbose(" Empty Block!");
@@ -216,60 +497,348 @@ void writeData(uint8_t* signkey)
             printf_verbose(".");
         }
 
-        // Special case for large flash MCUs
-        if (CODE_SIZE > 0xFFFF)
-        {
-            addr >>= 8;
+        // Special case for large flash MCUs, pages are addressed in 256 byte steps
+        uint16_t PageAddress = (CODE_SIZE > 0xFFFF) ? (addr >> 8) : addr;
+
+        // Load the actual flash page address and data into the next batch entry
+        ProgrammFlashPage_t* ProgrammFlashPage = &batch[batched++];
+        ProgrammFlashPage->PageAddress = PageAddress;
+        const uint8_t* page = ihex_get_page(addr, sizeof(ProgrammFlashPage->PageDataBytes), ProgrammFlashPage->PageDataBytes);
+        if (page != ProgrammFlashPage->PageDataBytes) {
+            memcpy(ProgrammFlashPage->PageDataBytes, page, sizeof(ProgrammFlashPage->PageDataBytes));
+        }
+
+        // Skip pages the device already has
+        if (delta && crc16(page, SPM_PAGESIZE) == checksums[addr / SPM_PAGESIZE]) {
+            batched--;
+            unchanged++;
+            continue;
+        }
+
+        // Sign and send a full batch
+        if (batched == SIGN_BATCH) {
+            writePages(batch, batched, batchPages, pipe, compress, &signtime);
+            batched = 0;
         }
+        pages++;
+    }
+    writePages(batch, batched, batchPages, pipe, compress, &signtime);
 
-        // Create a new flash page data structure
-        ProgrammFlashPage_t ProgrammFlashPage;
+    // Wait for all queued pages to be acknowledged
+    if (!SecureLoader_flush(1)) die("Error writing to SecureLoader\n");
+    readProgrammStatus(pipe, 1);
+    printf_verbose("\n");
+
+    // Report throughput. If host signing takes only a small share of the
+    // time, the USB transfer and the device are the bottleneck.
+    double elapsed = timestamp() - start;
+    if (elapsed > 0) {
+        printf_verbose("Programmed %d pages in %.3f s, %.1f pages/s, %.1f%% host signing time\n",
+            pages, elapsed, pages / elapsed, signtime / elapsed * 100.0);
+    }
+    if (delta) {
+        printf_verbose("Skipped %d unchanged pages\n", unchanged);
+    }
+    skipped_pages = unchanged;
+    return pages;
+}
+
+void writePages(ProgrammFlashPage_t* batch, int count, int batchPages, int pipe, int compress, double* signtime)
+{
+    const int step = (CODE_SIZE > 0xFFFF) ? (SPM_PAGESIZE >> 8) : SPM_PAGESIZE;
+    uint8_t requests[SIGN_BATCH][BATCH_REPORT_MAX];
+    uint8_t compressed[SIGN_BATCH][BATCH_REPORT_MAX];
+    int pages[SIGN_BATCH];
+    int lengths[SIGN_BATCH];
+    int n = 0;
+
+    // Combine consecutive pages into ProgrammFlashPages requests, a single
+    // page is sent as ProgrammFlashPage_t with the same layout
+    for (int i = 0; i < count; n++) {
+        int k = 1;
+        while (k < batchPages && i + k < count &&
+               batch[i + k].PageAddress == batch[i].PageAddress + k * step) {
+            k++;
+        }
 
-        // Load the actual flash page address and data
-        ProgrammFlashPage.PageAddress = addr;
-        ihex_get_data(addr, sizeof(ProgrammFlashPage.PageDataBytes), ProgrammFlashPage.PageDataBytes);
+        ProgrammFlashPages_t* request = (ProgrammFlashPages_t*)requests[n];
+        memset(request->padding, 0x00, sizeof(request->padding));
+        request->PageAddress = batch[i].PageAddress;
+        request->PageCount = (k > 1) ? k : 0;
+        for (int j = 0; j < k; j++) {
+            memcpy(&request->PageDataBytes[j * SPM_PAGESIZE], batch[i + j].PageDataBytes, SPM_PAGESIZE);
+        }
 
-        // Save key and initialization vector inside context
-        aes256_init(signkey, &ctx);
+        // The header block names the compressed length, so it is signed too
+        request->DataLength = compress ? compress_pages(request->PageDataBytes, k, compressed[n]) : 0;
+        pages[n] = k;
+        i += k;
+    }
 
-        // Calculate and save CBC-MAC
-        aes256CbcMacCalculate(&ctx, ProgrammFlashPage.raw, sizeof(ProgrammFlashPage.PageDataBytes) + sizeof(ProgrammFlashPage.padding));
+    // Calculate and save the CBC-MACs, one multi-buffer call per request size
+    double t = timestamp();
+    for (int k = 1; k <= batchPages; k++) {
+        uint8_t* data[SIGN_BATCH];
+        int lanes = 0;
+        for (int j = 0; j < n; j++) {
+            if (pages[j] == k) data[lanes++] = requests[j];
+        }
+        if (lanes) {
+            aes256CbcMacCalculateMulti(&ctx, data, lanes, PROGRAMM_FLASH_PAGES_LENGTH(k) - AES256_CBC_LENGTH);
+        }
+    }
+    *signtime += timestamp() - t;
+
+    // Replace the page data of compressed requests, the CBC-MAC moves up
+    for (int j = 0; j < n; j++) {
+        ProgrammFlashPages_t* request = (ProgrammFlashPages_t*)requests[j];
+        lengths[j] = PROGRAMM_FLASH_PAGES_LENGTH(pages[j]);
+        if (request->DataLength) {
+            memmove(&request->PageDataBytes[request->DataLength],
+                &requests[j][lengths[j] - AES256_CBC_LENGTH], AES256_CBC_LENGTH);
+            memcpy(request->PageDataBytes, compressed[j], request->DataLength);
+            lengths[j] = PROGRAMM_FLASH_PAGES_LENGTH(0) + request->DataLength;
+        }
+    }
 
-        // Write data to the AVR
-        int r = SecureLoader_write(ProgrammFlashPage.raw, sizeof(ProgrammFlashPage), 1);
+    // Write data to the AVR. In pipelined mode the requests are only queued
+    // and the next batch gets signed while these are still in flight.
+    for (int j = 0; j < n; j++) {
+        int r;
+        if (pipe == PIPE_INTERRUPT) {
+            // Zero padded to full reports, the device answers on the HID IN endpoint
+            int len = lengths[j];
+            int padded = (len + HID_REPORT_SIZE - 1) / HID_REPORT_SIZE * HID_REPORT_SIZE;
+            memset(requests[j] + len, 0x00, padded - len);
+            r = SecureLoader_write_interrupt(requests[j], padded, 1);
+            status_pending++;
+            readProgrammStatus(pipe, 0);
+        }
+        else if (pipe == PIPE_BULK) {
+            // Queued without padding, the device answers on the bulk IN endpoint
+            r = SecureLoader_write_bulk(requests[j], lengths[j], 1);
+            status_pending++;
+            readProgrammStatus(pipe, 0);
+        }
+        else if (pipeline_depth) {
+            r = SecureLoader_write_async(requests[j], lengths[j], 1);
+        }
+        else {
+            r = SecureLoader_write(requests[j], lengths[j], 1);
+        }
         if (!r) die("Error writing to SecureLoader\n");
     }
-    printf_verbose("\n");
+}
+
+int readCapabilities(BootloaderCapabilities_t* capabilities)
+{
+    // Older bootloaders stall the request and only take single pages
+    if (!SecureLoader_read(capabilities->raw, sizeof(*capabilities), 1) ||
+        capabilities->PageSize != SPM_PAGESIZE || capabilities->BatchPages < 1) {
+        memset(capabilities->raw, 0x00, sizeof(*capabilities));
+        capabilities->PageSize = SPM_PAGESIZE;
+        capabilities->BatchPages = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int readKeyLength(void)
+{
+    // Older bootloaders only know AES-256
+    BootloaderCapabilities_t capabilities;
+    readCapabilities(&capabilities);
+    return (capabilities.KeyLength == 16) ? 16 : 32;
+}
+
+void readProgrammStatus(int pipe, double timeout)
+{
+    // Every request on the HID OUT or bulk OUT endpoint is answered with one status report.
+    // Without a timeout only the reports that already arrived are read.
+    uint8_t report[HID_REPORT_SIZE];
+    while (status_pending) {
+        int r = (pipe == PIPE_BULK) ? SecureLoader_read_bulk(report, sizeof(report), timeout) :
+            SecureLoader_read_interrupt(report, sizeof(report), timeout);
+        if (!r) {
+            if (timeout > 0) die("Error reading status from SecureLoader\n");
+            return;
+        }
+        status_pending--;
+
+        ProgrammStatus_t* status = (ProgrammStatus_t*)report;
+        if (status->Status == PROGRAMM_STATUS_VERIFY_ERROR) {
+            die("Verify error at page 0x%04X\n", status->PageAddress);
+        }
+        if (status->Status != PROGRAMM_STATUS_OK) {
+            die("Error writing %d pages at 0x%04X to SecureLoader, status %d\n",
+                status->PageCount ? status->PageCount : 1, status->PageAddress, status->Status);
+        }
+    }
 }
 
 void changeKey(uint8_t* oldkey, uint8_t* newkey)
 {
     printf_verbose("Changing key\n");
 
-    // Get the data ready
+    uint8_t request[CHANGEKEY_REQUEST_SIZE];
+    signChangeKey(oldkey, newkey, request);
+
+    // Write data to the AVR
+    int r = SecureLoader_write(request, sizeof(request), 1);
+    if (!r) die("Error writing to SecureLoader\n");
+}
+
+void signChangeKey(uint8_t* oldkey, uint8_t* newkey, uint8_t* request)
+{
+    // Get the data ready, an AES-128 key is zero padded
+    int length = key_length ? key_length : key_bits / 8;
     newBootloaderKey_t newBootloaderKey;
-    memcpy(newBootloaderKey.data.BootloaderKey, newkey, sizeof(newBootloaderKey.data.BootloaderKey));
+    memset(newBootloaderKey.data.BootloaderKeyBlocks, 0, sizeof(newBootloaderKey.data.BootloaderKeyBlocks));
+    memcpy(newBootloaderKey.data.BootloaderKeyBlocks, newkey, length);
 
     // Initialize key schedule inside CTX
-    aes256_init(oldkey, &ctx);
+    aes256_init_key(&ctx, oldkey, length);
 
     // Encrypt the data
-    aes256CbcEncrypt(&ctx, newBootloaderKey.IV, sizeof(newBootloaderKey.data.BootloaderKey));
+    aes256CbcEncrypt(&ctx, newBootloaderKey.IV, sizeof(newBootloaderKey.data.BootloaderKeyBlocks));
 
     // Calculate and save CBC-MAC
-    aes256CbcMacCalculate(&ctx, newBootloaderKey.data.raw, sizeof(newBootloaderKey.data.BootloaderKey));
+    aes256CbcMacCalculate(&ctx, newBootloaderKey.data.raw, sizeof(newBootloaderKey.data.BootloaderKeyBlocks));
 
-    // Write data to the AVR
-    int r = SecureLoader_write(newBootloaderKey.data.raw, sizeof(newBootloaderKey.data), 1);
-    if (!r) die("Error writing to SecureLoader\n");
+    memcpy(request, newBootloaderKey.data.raw, sizeof(newBootloaderKey.data));
+}
+
+// Digest of a page run with the key in ctx, the same CBC-MAC the device calculates
+static void flash_digest_begin(FlashDigest_t* digest, uint16_t PageAddress, uint16_t PageCount)
+{
+    memset(digest->raw, 0, sizeof(*digest));
+    digest->request.PageAddress = PageAddress;
+    digest->request.PageCount = PageCount;
+    memcpy(digest->cbcMac, digest->request.raw, sizeof(digest->request));
+    digest->cbcMac[AES256_CBC_LENGTH - 1] = FLASH_DIGEST_TAG;
+    aes256_enc(digest->cbcMac, &ctx);
+}
+
+static void flash_digest_page(FlashDigest_t* digest, const uint8_t* data)
+{
+    for (int i = 0; i < SPM_PAGESIZE; i += AES256_CBC_LENGTH) {
+        aesXorVectors(digest->cbcMac, data + i, AES256_CBC_LENGTH);
+        aes256_enc(digest->cbcMac, &ctx);
+    }
 }
 
 void verifyData(void)
 {
     printf_verbose("Verifing\n");
+
+    // One digest per run of written pages, gaps were not touched on the device.
+    // ctx still holds the key the pages were signed with.
+    FlashDigest_t digest;
+    int runs = 0, pages = 0;
+    uint8_t pagebuf[SPM_PAGESIZE];
+
+    for (int addr = 0; addr < CODE_SIZE - BOOTLOADER_SIZE; ) {
+        // Same pages as writeData(), the first one is always written
+        if (addr > 0 && !ihex_page_used(addr)) {
+            addr += SPM_PAGESIZE;
+            continue;
+        }
+        int start = addr;
+        do {
+            addr += SPM_PAGESIZE;
+        } while (addr < CODE_SIZE - BOOTLOADER_SIZE && ihex_page_used(addr));
+        int run = (addr - start) / SPM_PAGESIZE;
+
+        // Special case for large flash MCUs, pages are addressed in 256 byte steps
+        uint16_t PageAddress = (CODE_SIZE > 0xFFFF) ? (start >> 8) : start;
+        flash_digest_begin(&digest, PageAddress, run);
+        for (int page = start; page < addr; page += SPM_PAGESIZE) {
+            flash_digest_page(&digest, ihex_get_page(page, sizeof(pagebuf), pagebuf));
+        }
+
+        // Bootloaders without the digest command stall it, read back every page instead
+        if (!verifyDigest(&digest)) {
+            printf_verbose("Flash digest not supported, reading back pages\n");
+            verifyPages();
+            return;
+        }
+        if (verbose == 1) {
+            printf_verbose(".");
+        }
+        pages += run;
+        runs++;
+    }
+    printf_verbose("\nVerified %d pages with %d digests\n", pages, runs);
+}
+
+int verifyDigest(const FlashDigest_t* expected)
+{
+    // Let the device calculate the CBC-MAC of the range
+    FlashDigest_t digest;
+    memcpy(digest.request.raw, expected->request.raw, sizeof(digest.request));
+    if (!SecureLoader_write(digest.request.raw, sizeof(digest.request), 1)) return 0;
+
+    int r = SecureLoader_read(digest.raw, sizeof(digest), 1);
+    if (!r) die("Error reading SecureLoader\n");
+
+    if (memcmp(digest.raw, expected->raw, sizeof(digest))) {
+        printf_verbose("Expected:\n");
+        hexdump(expected->raw, sizeof(digest));
+        printf_verbose("Received:\n");
+        hexdump(digest.raw, sizeof(digest));
+        die("Error verification mismatch\n");
+    }
+    return 1;
+}
+
+int readVerifyStatus(int pages)
+{
+    // Bootloaders without verify after write stall the request
+    VerifyStatus_t status;
+    if (!SecureLoader_read(status.raw, sizeof(status), 1)) {
+        printf_verbose("Verify after write not supported\n");
+        return 0;
+    }
+    if (status.ErrorCount) {
+        die("Verify error at page 0x%04X, %d pages failed\n", status.ErrorAddress, status.ErrorCount);
+    }
+
+    // The counts may include pages of an earlier upload
+    if (status.PageCount < pages) return 0;
+    printf_verbose("Device verified %d pages after writing\n", status.PageCount);
+    return 1;
+}
+
+int readPageChecksums(uint16_t* checksums)
+{
+    // The device returns up to PAGE_CHECKSUMS_MAX checksums per range
+    for (int first = 0; first < APPLICATION_PAGES; first += PAGE_CHECKSUMS_MAX) {
+        int addr = first * SPM_PAGESIZE;
+        FlashDigest_t range;
+        range.request.PageAddress = (CODE_SIZE > 0xFFFF) ? (addr >> 8) : addr;
+        range.request.PageCount = APPLICATION_PAGES - first;
+        if (range.request.PageCount > PAGE_CHECKSUMS_MAX) range.request.PageCount = PAGE_CHECKSUMS_MAX;
+
+        // Bootloaders without the command stall it, then every page is written
+        PageChecksums_t table;
+        if (!SecureLoader_write(range.request.raw, sizeof(range.request), 1) ||
+            !SecureLoader_read(table.raw, sizeof(table), 1) ||
+            table.PageAddress != range.request.PageAddress || table.PageCount != range.request.PageCount) {
+            printf_verbose("Page checksums not supported, writing all pages\n");
+            return 0;
+        }
+        memcpy(checksums + first, table.Checksums, table.PageCount * sizeof(uint16_t));
+    }
+    return 1;
+}
+
+void verifyPages(void)
+{
+    read_pointer = -1;
+    read_pointer_advances = 1;
     for (int addr = 0; addr < CODE_SIZE; addr += SPM_PAGESIZE) {
         printf_high_verbose("\n%d", addr);
-        if (addr > 0 && !ihex_bytes_within_range(addr, addr + SPM_PAGESIZE - 1)) {
+        if (addr > 0 && !ihex_page_used(addr)) {
             // don't waste time on blocks that are unused,
             // but always do the first one to erase the chip
             printf_high_verbose(" Empty Block!");
@@ -284,136 +853,1266 @@ void verifyData(void)
             printf_verbose(".");
         }
 
-        // Special case for large flash MCUs
-        if (CODE_SIZE > 0xFFFF)
-        {
-            addr >>= 8;
-        }
+        // Special case for large flash MCUs, pages are addressed in 256 byte steps
+        uint16_t PageAddress = (CODE_SIZE > 0xFFFF) ? (addr >> 8) : addr;
+
+        // Get hex file data, usually directly from the loaded image
+        uint8_t pagebuf[SPM_PAGESIZE];
+        const uint8_t* page = ihex_get_page(addr, sizeof(pagebuf), pagebuf);
+        verifyPage(PageAddress, page);
+    }
+    printf_verbose("\n");
+}
+
+void verifyPage(uint16_t PageAddress, const uint8_t* data)
+{
+    const int step = (CODE_SIZE > 0xFFFF) ? (SPM_PAGESIZE >> 8) : SPM_PAGESIZE;
 
-        // Request page
-        SetFlashPage_t SetFlashPage = { .PageAddress = addr};
+    // Request page, the device already points to the page after the last one
+    bool consecutive = read_pointer_advances && (read_pointer == PageAddress);
+    if (!consecutive) {
+        SetFlashPage_t SetFlashPage = { .PageAddress = PageAddress};
         int r = SecureLoader_write(SetFlashPage.raw, sizeof(SetFlashPage), 1);
         if (!r) die("Error writing to SecureLoader\n");
+    }
 
-        // Get data from AVR
-        ReadFlashPage_t verifybuf;
-        r = SecureLoader_read(verifybuf.raw, sizeof(verifybuf), 1);
-        if (!r) die("Error reading SecureLoader\n");
+    // Get data from AVR
+    ReadFlashPage_t verifybuf;
+    int r = SecureLoader_read(verifybuf.raw, sizeof(verifybuf), 1);
+    if (!r) die("Error reading SecureLoader\n");
+    read_pointer = PageAddress + step;
 
-        // Get hex file data
-        ReadFlashPage_t originalbuf = { .PageAddress = addr};
-        ihex_get_data(addr, sizeof(originalbuf.PageDataBytes), originalbuf.PageDataBytes);
+    // Older bootloaders return the last page again
+    if (consecutive && verifybuf.PageAddress != PageAddress) {
+        read_pointer_advances = 0;
+        verifyPage(PageAddress, data);
+        return;
+    }
 
-        // Compare the data
-        if(memcmp(verifybuf.raw, originalbuf.raw, sizeof(originalbuf))){
-            printf_verbose("Expected:\n");
-            hexdump(originalbuf.raw, sizeof(originalbuf));
-            printf_verbose("Received:\n");
-            hexdump(verifybuf.raw, sizeof(verifybuf));
-            die("Error verification mismatch\n");
-        }
+    // Compare the data
+    if(verifybuf.PageAddress != PageAddress || memcmp(verifybuf.PageDataBytes, data, sizeof(verifybuf.PageDataBytes))){
+        printf_verbose("Expected:\n");
+        hexdump(data, sizeof(verifybuf.PageDataBytes));
+        printf_verbose("Received:\n");
+        hexdump(verifybuf.raw, sizeof(verifybuf));
+        die("Error verification mismatch\n");
     }
-    printf_verbose("\n");
 }
 
 
 /****************************************************************/
 /*                                                              */
-/*             USB Access - libusb (Linux & FreeBSD)            */
+/*                     Firmware Packages                        */
 /*                                                              */
 /****************************************************************/
 
-#if defined(USE_LIBUSB)
+static size_t package_record_length(int type)
+{
+    switch (type) {
+    case PACKAGE_AUTHENTICATE: return AUTHENTICATE_REQUEST_SIZE + AES256_CBC_LENGTH;
+    case PACKAGE_CHANGEKEY: return CHANGEKEY_REQUEST_SIZE;
+    case PACKAGE_PAGE: return sizeof(ProgrammFlashPage_t);
+    case PACKAGE_DIGEST: return sizeof(FlashDigest_t);
+    default: return 0;
+    }
+}
 
-// http://libusb.sourceforge.net/doc/index.html
-#include <usb.h>
+int signFirmware(void)
+{
+    uint8_t signkey[32], newkey[32];
 
-usb_dev_handle * open_usb_device(int vid, int pid)
+    if (!package_output) die("Output package must be specified with -o\n");
+    if (fleet_keyfile || master_key || serial_file) return signBatch();
+    memcpy(signkey, key, sizeof(signkey));
+    if (sign_key && !parse_key(sign_key, signkey)) die("Invalid key \"%s\"\n", sign_key);
+    if (new_key && !parse_key(new_key, newkey)) die("Invalid key \"%s\"\n", new_key);
+
+    int num = read_intel_hex(filename);
+    if (num < 0) die("Error reading Intel hex file \"%s\"", filename);
+
+    ProgrammFlashPage_t* pages;
+    int count = collectPages(&pages);
+    size_t size;
+    uint8_t* data = buildPackage(pages, count, signkey, new_key ? newkey : NULL, &size);
+    free(pages);
+
+    FILE *fp = fopen(package_output, "wb");
+    if (!fp) die("Unable to write package \"%s\"\n", package_output);
+    if (fwrite(data, 1, size, fp) != size || fclose(fp)) die("Unable to write package \"%s\"\n", package_output);
+    free(data);
+
+    printf_verbose("Wrote \"%s\": %d pages, %lu bytes\n", package_output, count, (unsigned long)size);
+    return 0;
+}
+
+int collectPages(ProgrammFlashPage_t** pages)
 {
-    struct usb_bus *bus;
-    struct usb_device *dev;
-    usb_dev_handle *h;
-    #ifdef LIBUSB_HAS_GET_DRIVER_NP
-    char buf[128];
-    #endif
-    int r;
+    // Same pages as writeData() would send, without the CBC-MAC
+    *pages = malloc((CODE_SIZE / SPM_PAGESIZE) * sizeof(ProgrammFlashPage_t));
+    if (!*pages) die("Out of memory\n");
+
+    int count = 0;
+    for (int addr = 0; addr < CODE_SIZE - BOOTLOADER_SIZE; addr += SPM_PAGESIZE) {
+        if (addr > 0 && !ihex_page_used(addr)) continue;
+
+        ProgrammFlashPage_t* page = &(*pages)[count++];
+        memset(page->raw, 0, sizeof(*page));
+        page->PageAddress = (CODE_SIZE > 0xFFFF) ? (addr >> 8) : addr;
+        ihex_get_data(addr, sizeof(page->PageDataBytes), page->PageDataBytes);
+    }
+    return count;
+}
 
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-    //printf_verbose("\nSearching for USB device:\n");
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            //printf_verbose("bus \"%s\", device \"%s\" vid=%04X, pid=%04X\n",
-            //    bus->dirname, dev->filename,
-            //    dev->descriptor.idVendor,
-            //    dev->descriptor.idProduct
-            //);
-            if (dev->descriptor.idVendor != vid) continue;
-            if (dev->descriptor.idProduct != pid) continue;
-            h = usb_open(dev);
-            if (!h) {
-                printf_verbose("Found device but unable to open");
-                continue;
-            }
-            #ifdef LIBUSB_HAS_GET_DRIVER_NP
-            r = usb_get_driver_np(h, 0, buf, sizeof(buf));
-            if (r >= 0) {
-                r = usb_detach_kernel_driver_np(h, 0);
-                if (r < 0) {
-                    usb_close(h);
-                    printf_verbose("Device is in use by \"%s\" driver", buf);
-                    continue;
-                }
-            }
-            #endif
-            // Mac OS-X - removing this call to usb_claim_interface() might allow
-            // this to work, even though it is a clear misuse of the libusb API.
-            // normally Apple's IOKit should be used on Mac OS-X
-            r = usb_claim_interface(h, 0);
-            if (r < 0) {
-                usb_close(h);
-                printf_verbose("Unable to claim interface, check USB permissions");
-                continue;
-            }
-            return h;
+/* Threat model of the authentication records: the challenge is fixed when signing
+ * and stored in plain text next to the signed request. Anyone with the package can
+ * replay the request, and a counterfeit device that knows the package can answer it
+ * without the Bootloader Key. The records only catch a device with the wrong key
+ * before any page is sent, they do not prove the device is genuine. The pages are
+ * safe either way, the device only writes pages with a valid CBC-MAC of its key.
+ * To check the device, sign with -A and flash with -K (and -N), then a fresh random
+ * challenge is sent live.
+ */
+uint8_t* buildPackage(const ProgrammFlashPage_t* pages, int count, uint8_t* signkey, uint8_t* newkey, size_t* size)
+{
+    // Authenticate, optionally install and check a new key, then write all pages.
+    // The digests of every run of consecutive pages verify the result.
+    const int step = (CODE_SIZE > 0xFFFF) ? (SPM_PAGESIZE >> 8) : SPM_PAGESIZE;
+    int runs = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || pages[i].PageAddress != pages[i - 1].PageAddress + step) runs++;
+    }
+    int first_page = 0, authenticates = 0;
+    int head[3];
+    if (package_authenticate) head[first_page++] = PACKAGE_AUTHENTICATE;
+    if (newkey) {
+        head[first_page++] = PACKAGE_CHANGEKEY;
+        if (package_authenticate) head[first_page++] = PACKAGE_AUTHENTICATE;
+    }
+    for (int i = 0; i < first_page; i++) {
+        if (head[i] == PACKAGE_AUTHENTICATE) authenticates++;
+    }
+    int records = first_page + count + runs;
+    size_t offset = PACKAGE_ALIGN(sizeof(package_header_t) + records * sizeof(package_index_t));
+    size_t total = offset + count * sizeof(ProgrammFlashPage_t) +
+        PACKAGE_ALIGN(package_record_length(PACKAGE_AUTHENTICATE)) * authenticates +
+        (newkey ? PACKAGE_ALIGN(package_record_length(PACKAGE_CHANGEKEY)) : 0) +
+        runs * PACKAGE_ALIGN(package_record_length(PACKAGE_DIGEST));
+
+    uint8_t* data = calloc(1, total);
+    if (!data) die("Out of memory\n");
+    package_header_t* header = (package_header_t*)data;
+    package_index_t* index = (package_index_t*)(data + sizeof(package_header_t));
+    memcpy(header->magic, PACKAGE_MAGIC, sizeof(header->magic));
+    header->version = PACKAGE_VERSION;
+    header->pagesize = SPM_PAGESIZE;
+    header->records = records;
+    header->size = total;
+    header->keylength = key_bits / 8;
+
+    uint8_t* authkey = signkey;
+    for (int i = 0; i < records; i++) {
+        int type = PACKAGE_PAGE;
+        if (i < first_page) type = head[i];
+        else if (i >= first_page + count) type = PACKAGE_DIGEST;
+
+        index[i].type = type;
+        index[i].offset = offset;
+        index[i].length = package_record_length(type);
+        offset += PACKAGE_ALIGN(index[i].length);
+
+        // The challenge is fixed when signing, every device gets the same one
+        uint8_t* record = data + index[i].offset;
+        if (type == PACKAGE_AUTHENTICATE) {
+            uint8_t* challenge = record + AUTHENTICATE_REQUEST_SIZE;
+            random_bytes(challenge, AES256_CBC_LENGTH);
+            signAuthenticate(authkey, challenge, record);
+        }
+        else if (type == PACKAGE_CHANGEKEY) {
+            signChangeKey(signkey, newkey, record);
+            authkey = newkey;
+        }
+    }
+
+    // Pages are stored back to back and signed at once
+    uint8_t** lanes = malloc((count ? count : 1) * sizeof(uint8_t*));
+    ProgrammFlashPage_t* signed_pages = (ProgrammFlashPage_t*)(data + index[first_page].offset);
+    if (!lanes) die("Out of memory\n");
+    memcpy(signed_pages, pages, count * sizeof(ProgrammFlashPage_t));
+    for (int i = 0; i < count; i++) {
+        lanes[i] = signed_pages[i].raw;
+    }
+    aes256_init_key(&ctx, newkey ? newkey : signkey, key_bits / 8);
+    aes256CbcMacCalculateMulti(&ctx, lanes, count, sizeof(pages[0].PageDataBytes) + sizeof(pages[0].padding));
+    free(lanes);
+
+    // Expected flash digests, with the same key as the pages
+    for (int i = 0, run = 0; run < runs; run++) {
+        int start = i;
+        do {
+            i++;
+        } while (i < count && pages[i].PageAddress == pages[i - 1].PageAddress + step);
+
+        FlashDigest_t* digest = (FlashDigest_t*)(data + index[first_page + count + run].offset);
+        flash_digest_begin(digest, pages[start].PageAddress, i - start);
+        for (int page = start; page < i; page++) {
+            flash_digest_page(digest, pages[page].PageDataBytes);
         }
     }
-    return NULL;
+
+    *size = total;
+    return data;
+}
+
+int package_open(const char *path)
+{
+    package_close();
+
+#if defined(_WIN32)
+    FILE *fp = fopen(path, "rb");
+    long size;
+    if (!fp) return 0;
+    if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET)) {
+        fclose(fp);
+        return 0;
+    }
+    package.data = malloc(size ? size : 1);
+    if (!package.data || fread(package.data, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        package_close();
+        return 0;
+    }
+    fclose(fp);
+    package.size = size;
+#else
+    // Map the package, records are sent straight from the mapping.
+    // Private and writable, so the backends may use the buffers like any other.
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    package.data = map;
+    package.size = st.st_size;
+    package.mapped = true;
+#endif
+
+    // Check the header and that every record lies inside the file
+    package.header = (const package_header_t*)package.data;
+    package.index = (const package_index_t*)(package.data + sizeof(package_header_t));
+    if (package.size < sizeof(package_header_t) ||
+        memcmp(package.header->magic, PACKAGE_MAGIC, sizeof(package.header->magic)) ||
+        package.header->version != PACKAGE_VERSION ||
+        package.header->pagesize != SPM_PAGESIZE ||
+        package.header->size != package.size ||
+        (package.header->keylength != 0 && package.header->keylength != 16 && package.header->keylength != 32) ||
+        package.header->records > (package.size - sizeof(package_header_t)) / sizeof(package_index_t)) {
+        package_close();
+        return 0;
+    }
+    for (uint32_t i = 0; i < package.header->records; i++) {
+        const package_index_t* entry = &package.index[i];
+        if (entry->length != package_record_length(entry->type) ||
+            entry->offset > package.size || entry->length > package.size - entry->offset) {
+            package_close();
+            return 0;
+        }
+        if (entry->type == PACKAGE_PAGE) package.pages++;
+    }
+    return 1;
+}
+
+void package_close(void)
+{
+    if (package.data) {
+#if defined(_WIN32)
+        free(package.data);
+#else
+        if (package.mapped) munmap(package.data, package.size);
+#endif
+    }
+    memset(&package, 0, sizeof(package));
+}
+
+// signkey and newkey authenticate the device live with a fresh challenge, before
+// and after a key change. Without them the recorded challenges are replayed.
+int writePackage(uint8_t* signkey, uint8_t* newkey)
+{
+    printf_verbose("Programming package\n");
+
+    int pages = 0, unchanged = 0;
+    double start = timestamp();
+
+    // Checksums of the pages that are already on the device
+    uint16_t checksums[APPLICATION_PAGES];
+    bool delta = delta_update && readPageChecksums(checksums);
+
+    // The package has to be signed for the key size of the device
+    int keyLength = package.header->keylength ? package.header->keylength : 32;
+    int deviceKeyLength = readKeyLength();
+    if (keyLength != deviceKeyLength) {
+        die("Package is signed with a %d bit key, the device uses %d bit\n", 8 * keyLength, 8 * deviceKeyLength);
+    }
+
+    uint8_t* authkey = signkey;
+    if (authkey) authenticate(authkey);
+
+    for (uint32_t i = 0; i < package.header->records; i++) {
+        const package_index_t* entry = &package.index[i];
+        uint8_t* record = package.data + entry->offset;
+
+        // Digests are only used for verification
+        if (entry->type == PACKAGE_DIGEST) continue;
+
+        // Everything before a key change or authentication has to be acknowledged
+        if (entry->type != PACKAGE_PAGE && !SecureLoader_flush(1)) {
+            die("Error writing to SecureLoader\n");
+        }
+
+        int r = 1;
+        switch (entry->type) {
+        case PACKAGE_AUTHENTICATE:
+            // Already done live with the key
+            if (authkey) break;
+            printf_verbose("Authenticating Secureloader\n");
+            sendAuthenticate(record, record + AUTHENTICATE_REQUEST_SIZE);
+            break;
+
+        case PACKAGE_CHANGEKEY:
+            printf_verbose("Changing key\n");
+            r = SecureLoader_write(record, entry->length, 1);
+            authkey = newkey;
+            if (r && authkey) authenticate(authkey);
+            break;
+
+        case PACKAGE_PAGE:
+            if (delta) {
+                // Skip pages the device already has
+                const ProgrammFlashPage_t* page = (const ProgrammFlashPage_t*)record;
+                int addr = (CODE_SIZE > 0xFFFF) ? (page->PageAddress << 8) : page->PageAddress;
+                if (addr < CODE_SIZE - BOOTLOADER_SIZE &&
+                    crc16(page->PageDataBytes, SPM_PAGESIZE) == checksums[addr / SPM_PAGESIZE]) {
+                    unchanged++;
+                    break;
+                }
+            }
+            if (verbose == 1) {
+                printf_verbose(".");
+            }
+            if (pipeline_depth) {
+                r = SecureLoader_write_async(record, entry->length, 1);
+            }
+            else {
+                r = SecureLoader_write(record, entry->length, 1);
+            }
+            pages++;
+            break;
+        }
+        if (!r) die("Error writing to SecureLoader\n");
+    }
+
+    // Wait for all queued pages to be acknowledged
+    if (!SecureLoader_flush(1)) die("Error writing to SecureLoader\n");
+    printf_verbose("\n");
+
+    double elapsed = timestamp() - start;
+    if (elapsed > 0) {
+        printf_verbose("Programmed %d pages in %.3f s, %.1f pages/s\n", pages, elapsed, pages / elapsed);
+    }
+    if (delta) {
+        printf_verbose("Skipped %d unchanged pages\n", unchanged);
+    }
+    skipped_pages = unchanged;
+    return pages;
+}
+
+void verifyPackage(void)
+{
+    printf_verbose("Verifing\n");
+
+    // One request per digest, if the package and the bootloader have them
+    int digests = 0;
+    for (uint32_t i = 0; i < package.header->records; i++) {
+        const package_index_t* entry = &package.index[i];
+        if (entry->type != PACKAGE_DIGEST) continue;
+
+        if (!verifyDigest((const FlashDigest_t*)(package.data + entry->offset))) {
+            printf_verbose("Flash digest not supported, reading back pages\n");
+            digests = 0;
+            break;
+        }
+        if (verbose == 1) {
+            printf_verbose(".");
+        }
+        digests++;
+    }
+    if (digests) {
+        printf_verbose("\nVerified %d pages with %d digests\n", package.pages, digests);
+        return;
+    }
+
+    read_pointer = -1;
+    read_pointer_advances = 1;
+    for (uint32_t i = 0; i < package.header->records; i++) {
+        const package_index_t* entry = &package.index[i];
+        if (entry->type != PACKAGE_PAGE) continue;
+
+        if (verbose == 1) {
+            printf_verbose(".");
+        }
+        const ProgrammFlashPage_t* page = (const ProgrammFlashPage_t*)(package.data + entry->offset);
+        verifyPage(page->PageAddress, page->PageDataBytes);
+    }
+    printf_verbose("\n");
+}
+
+
+/****************************************************************/
+/*                                                              */
+/*                      Batch Signing                           */
+/*                                                              */
+/****************************************************************/
+
+// One package per device, signed with the key of that device
+typedef struct {
+    char name[SECURELOADER_PATH_MAX];
+    uint8_t key[32];
+    bool failed;
+} sign_job_t;
+
+typedef struct {
+    const ProgrammFlashPage_t* pages;
+    int count;
+    sign_job_t* jobs;
+    size_t bytes;
+} sign_batch_t;
+
+static int sign_load_jobs(sign_job_t** jobs)
+{
+    uint8_t masterkey[32];
+    const char* listfile = master_key ? serial_file : fleet_keyfile;
+    int count = 0, alloc = 0, lineno = 0;
+    char line[SECURELOADER_PATH_MAX + 80];
+
+    if (master_key && !parse_key(master_key, masterkey)) die("Invalid key \"%s\"\n", master_key);
+    if (master_key && !serial_file) die("Serial file must be specified with -S\n");
+    if (!master_key && !fleet_keyfile) die("Master key must be specified with -M\n");
+
+    FILE *fp = fopen(listfile, "r");
+    if (!fp) die("Unable to read \"%s\"\n", listfile);
+
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        char name[SECURELOADER_PATH_MAX], hex[80];
+        lineno++;
+        if (*line == '#') continue;
+
+        // Key list: "<name> <hex key>", serial list: "<serial>"
+        int fields = sscanf(line, "%255s %79s", name, hex);
+        if (fields < (master_key ? 1 : 2)) continue;
+
+        // The name becomes the file name of the package
+        for (char* c = name; *c; c++) {
+            if (*c == '/' || *c == '\\' || *c == ':') *c = '_';
+        }
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            *jobs = realloc(*jobs, alloc * sizeof(sign_job_t));
+            if (!*jobs) die("Out of memory\n");
+        }
+        sign_job_t* job = &(*jobs)[count++];
+        memcpy(job->name, name, sizeof(name));
+        job->failed = false;
+        if (master_key) {
+            deriveKey(masterkey, name, job->key);
+        }
+        else if (!parse_key(hex, job->key)) {
+            die("Invalid key in \"%s\" line %d\n", listfile, lineno);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static void sign_device(void *arg, int index)
+{
+    sign_batch_t* batch = arg;
+    sign_job_t* job = &batch->jobs[index];
+    char path[2 * SECURELOADER_PATH_MAX];
+    size_t size;
+
+    // The pages are shared read only, every package gets its own copy
+    uint8_t* data = buildPackage(batch->pages, batch->count, job->key, NULL, &size);
+
+    snprintf(path, sizeof(path), "%s/%s.slp", package_output, job->name);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(data, 1, size, fp) != size) job->failed = true;
+    if (fp && fclose(fp)) job->failed = true;
+    free(data);
+
+    if (!job->failed) __atomic_fetch_add(&batch->bytes, size, __ATOMIC_RELAXED);
+}
+
+int signBatch(void)
+{
+    if (new_key) die("-N can not be used for batch signing\n");
+
+    sign_batch_t batch = { .bytes = 0 };
+    int devices = sign_load_jobs(&batch.jobs);
+    if (!devices) die("No devices to sign for\n");
+
+    // Parse the image once for all devices
+    int num = read_intel_hex(filename);
+    if (num < 0) die("Error reading Intel hex file \"%s\"", filename);
+    ProgrammFlashPage_t* pages;
+    batch.count = collectPages(&pages);
+    batch.pages = pages;
+
+    // Signing is CPU bound, by default use one thread per core
+    int threads = fleet_threads;
+#if defined(_SC_NPROCESSORS_ONLN)
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads < 1) threads = 1;
+    printf_verbose("Signing %d pages for %d devices with %d threads\n", batch.count, devices, threads);
+
+    double start = timestamp();
+    run_parallel(devices, threads, sign_device, &batch);
+    double elapsed = timestamp() - start;
+
+    int failed = 0;
+    for (int i = 0; i < devices; i++) {
+        if (batch.jobs[i].failed) {
+            printf("%-32s FAILED  unable to write package\n", batch.jobs[i].name);
+            failed++;
+        }
+    }
+    printf("%d of %d packages signed in %.3f s, %.1f devices/s, %.1f MB/s\n",
+        devices - failed, devices, elapsed, elapsed > 0 ? devices / elapsed : 0.0,
+        elapsed > 0 ? batch.bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+
+    free(pages);
+    free(batch.jobs);
+    return failed ? 1 : 0;
+}
+
+void deriveKey(const uint8_t* masterkey, const char* serial, uint8_t* devkey)
+{
+    // Each key half is the CBC-MAC of (half, serial length, serial) under
+    // the master key. The length in the first block keeps the inputs prefix free.
+    size_t len = strlen(serial);
+    size_t blocks = (len + 2 + AES256_CBC_LENGTH - 1) / AES256_CBC_LENGTH;
+    uint8_t data[blocks * AES256_CBC_LENGTH + AES256_CBC_LENGTH];
+    aes256_ctx_t kdf;
+
+    aes256_init((uint8_t*)masterkey, &kdf);
+    for (int half = 0; half < 2; half++) {
+        memset(data, 0, sizeof(data));
+        data[0] = half + 1;
+        data[1] = len;
+        memcpy(data + 2, serial, len);
+        aes256CbcMacCalculate(&kdf, data, blocks * AES256_CBC_LENGTH);
+        memcpy(devkey + half * AES256_CBC_LENGTH, data + blocks * AES256_CBC_LENGTH, AES256_CBC_LENGTH);
+    }
+    aes256_done(&kdf);
+}
+
+/****************************************************************/
+/*                                                              */
+/*                     Fleet Programming                        */
+/*                                                              */
+/****************************************************************/
+
+// Programming steps of a single device
+typedef enum {
+    DEVICE_WAITING,
+    DEVICE_OPENING,
+    DEVICE_AUTHENTICATING,
+    DEVICE_PROGRAMMING,
+    DEVICE_VERIFYING,
+    DEVICE_BOOTING,
+    DEVICE_DONE,
+    DEVICE_FAILED,
+} device_state_t;
+
+static const char* device_state_names[] = {
+    "waiting", "opening", "authenticating", "programming",
+    "verifying", "booting", "done", "failed",
+};
+
+typedef struct {
+    char path[SECURELOADER_PATH_MAX];
+    uint8_t key[32];
+    device_state_t state;
+    device_state_t failed_state;
+    int pages;
+    double seconds;
+    char error[128];
+} fleet_device_t;
+
+static fleet_device_t fleet_devices[FLEET_MAX_DEVICES];
+
+// Per thread error handler, die() jumps back to the fleet worker
+static __thread jmp_buf* die_handler = NULL;
+static __thread char* die_message = NULL;
+
+void fleet_add_device(const char *path)
+{
+    if (fleet_count >= FLEET_MAX_DEVICES) die("Too many devices\n");
+    if (strlen(path) >= SECURELOADER_PATH_MAX) die("Device path too long\n");
+    memcpy(fleet_devices[fleet_count++].path, path, strlen(path) + 1);
+}
+
+static void fleet_load_keys(void)
+{
+    // Every device uses the default key unless the key file says otherwise
+    for (int i = 0; i < fleet_count; i++) {
+        memcpy(fleet_devices[i].key, key, sizeof(key));
+    }
+    if (!fleet_keyfile) return;
+
+    FILE *fp = fopen(fleet_keyfile, "r");
+    if (!fp) die("Unable to read key file \"%s\"", fleet_keyfile);
+
+    // Apply "*" entries first, so exact path entries take precedence
+    for (int pass = 0; pass < 2; pass++) {
+        char line[SECURELOADER_PATH_MAX + 80];
+        int lineno = 0;
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            char path[SECURELOADER_PATH_MAX], hex[80];
+            uint8_t devkey[32];
+            lineno++;
+            if (*line == '#' || sscanf(line, "%255s %79s", path, hex) != 2) continue;
+
+            bool wildcard = !strcmp(path, "*");
+            if (wildcard != (pass == 0)) continue;
+            if (!parse_key(hex, devkey)) die("Invalid key in \"%s\" line %d", fleet_keyfile, lineno);
+
+            for (int i = 0; i < fleet_count; i++) {
+                if (wildcard || !strcmp(path, fleet_devices[i].path)) {
+                    memcpy(fleet_devices[i].key, devkey, sizeof(devkey));
+                }
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void fleet_program_device(void *arg, int index)
+{
+    fleet_device_t *dev = &fleet_devices[index];
+    double start = timestamp();
+    jmp_buf handler;
+
+    // Errors of this device must not abort the others
+    die_handler = &handler;
+    die_message = dev->error;
+    if (setjmp(handler)) {
+        dev->failed_state = dev->state;
+        dev->state = DEVICE_FAILED;
+        SecureLoader_close();
+        dev->seconds = timestamp() - start;
+        die_handler = NULL;
+        return;
+    }
+
+    dev->state = DEVICE_OPENING;
+    if (!SecureLoader_open_path(dev->path)) die("Unable to open device\n");
+
+    // A package contains the authentication, the key file allows a live one
+    if (package.data) {
+        dev->state = DEVICE_PROGRAMMING;
+        dev->pages = writePackage(fleet_keyfile ? dev->key : NULL, NULL);
+
+        dev->state = DEVICE_VERIFYING;
+        if (!readVerifyStatus(dev->pages) || !device_verify_only || skipped_pages) verifyPackage();
+    }
+    else {
+        dev->state = DEVICE_AUTHENTICATING;
+        authenticate(dev->key);
+
+        dev->state = DEVICE_PROGRAMMING;
+        dev->pages = writeData(dev->key);
+
+        dev->state = DEVICE_VERIFYING;
+        if (!readVerifyStatus(dev->pages) || !device_verify_only || skipped_pages) verifyData();
+    }
+
+    if (reboot_after_programming) {
+        dev->state = DEVICE_BOOTING;
+        SetFlashPage_t SetFlashPage = { .PageAddress = COMMAND_STARTAPPLICATION };
+        int r = SecureLoader_write(SetFlashPage.raw, sizeof(SetFlashPage), 1);
+        if (!r) die("Error writing to SecureLoader\n");
+    }
+    SecureLoader_close();
+
+    dev->state = DEVICE_DONE;
+    dev->seconds = timestamp() - start;
+    die_handler = NULL;
+}
+
+int fleet_program(void)
+{
+    // Find all bootloaders if no explicit device paths were given
+    if (fleet_all_devices) {
+        char paths[FLEET_MAX_DEVICES][SECURELOADER_PATH_MAX];
+        int n = SecureLoader_enumerate(paths, FLEET_MAX_DEVICES);
+        for (int i = 0; i < n; i++) {
+            fleet_add_device(paths[i]);
+        }
+    }
+    if (!fleet_count) die("No devices found\n");
+    fleet_load_keys();
+
+    // Flashing is bound by USB and the devices, not by the host CPU,
+    // so by default every device gets its own worker.
+    int threads = fleet_threads ? fleet_threads : fleet_count;
+    printf_verbose("Programming %d devices with %d threads\n", fleet_count, threads);
+
+    double start = timestamp();
+    run_parallel(fleet_count, threads, fleet_program_device, NULL);
+    double elapsed = timestamp() - start;
+
+    // Print a combined summary
+    int failed = 0, pages = 0;
+    for (int i = 0; i < fleet_count; i++) {
+        fleet_device_t *dev = &fleet_devices[i];
+        if (dev->state == DEVICE_DONE) {
+            printf("%-32s done    %4d pages %6.2f s\n", dev->path, dev->pages, dev->seconds);
+            pages += dev->pages;
+        }
+        else {
+            printf("%-32s FAILED  while %s: %s\n", dev->path,
+                device_state_names[dev->failed_state], dev->error);
+            failed++;
+        }
+    }
+    printf("%d of %d devices programmed in %.2f s, %.1f pages/s total\n",
+        fleet_count - failed, fleet_count, elapsed, elapsed > 0 ? pages / elapsed : 0.0);
+
+    return failed ? 1 : 0;
+}
+
+
+/****************************************************************/
+/*                                                              */
+/*             USB Access - libusb (Linux & FreeBSD)            */
+/*                                                              */
+/****************************************************************/
+
+#if defined(USE_LIBUSB)
+
+// http://libusb.sourceforge.net/doc/index.html
+#include <usb.h>
+
+usb_dev_handle * open_usb_device(int vid, int pid)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+    usb_dev_handle *h;
+    #ifdef LIBUSB_HAS_GET_DRIVER_NP
+    char buf[128];
+    #endif
+    int r;
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+    //printf_verbose("\nSearching for USB device:\n");
+    for (bus = usb_get_busses(); bus; bus = bus->next) {
+        for (dev = bus->devices; dev; dev = dev->next) {
+            //printf_verbose("bus \"%s\", device \"%s\" vid=%04X, pid=%04X\n",
+            //    bus->dirname, dev->filename,
+            //    dev->descriptor.idVendor,
+            //    dev->descriptor.idProduct
+            //);
+            if (dev->descriptor.idVendor != vid) continue;
+            if (dev->descriptor.idProduct != pid) continue;
+            h = usb_open(dev);
+            if (!h) {
+                printf_verbose("Found device but unable to open");
+                continue;
+            }
+            #ifdef LIBUSB_HAS_GET_DRIVER_NP
+            r = usb_get_driver_np(h, 0, buf, sizeof(buf));
+            if (r >= 0) {
+                r = usb_detach_kernel_driver_np(h, 0);
+                if (r < 0) {
+                    usb_close(h);
+                    printf_verbose("Device is in use by \"%s\" driver", buf);
+                    continue;
+                }
+            }
+            #endif
+            // Mac OS-X - removing this call to usb_claim_interface() might allow
+            // this to work, even though it is a clear misuse of the libusb API.
+            // normally Apple's IOKit should be used on Mac OS-X
+            r = usb_claim_interface(h, 0);
+            if (r < 0) {
+                usb_close(h);
+                printf_verbose("Unable to claim interface, check USB permissions");
+                continue;
+            }
+            return h;
+        }
+    }
+    return NULL;
+}
+
+static usb_dev_handle *libusb_SecureLoader_handle = NULL;
+
+int SecureLoader_open(void)
+{
+    SecureLoader_close();
+    libusb_SecureLoader_handle = open_usb_device(VENDOR_ID, PRODUCT_ID);
+
+    if (!libusb_SecureLoader_handle)
+        libusb_SecureLoader_handle = open_usb_device(0x03eb, 0x2067);
+
+    if (!libusb_SecureLoader_handle) return 0;
+    return 1;
+}
+
+int SecureLoader_write(void *buf, int len, double timeout)
+{
+    int r;
+
+    if (!libusb_SecureLoader_handle) return 0;
+    // 0x0100 out, 0x0200 feature
+    r = usb_control_msg(libusb_SecureLoader_handle, 0x21, 9, 0x0200, 0, (char *)buf,
+        len, (int)(timeout * 1000.0));
+    if (r < 0) return 0;
+    return 1;
+}
+
+void SecureLoader_close(void)
+{
+    if (!libusb_SecureLoader_handle) return;
+    usb_release_interface(libusb_SecureLoader_handle, 0);
+    usb_close(libusb_SecureLoader_handle);
+    libusb_SecureLoader_handle = NULL;
+}
+
+#endif
+
+
+/****************************************************************/
+/*                                                              */
+/*        USB Access - libusb-1.0 (Linux, FreeBSD, Mac OS-X)    */
+/*                                                              */
+/****************************************************************/
+
+#if defined(USE_LIBUSB1)
+
+// http://libusb.info/
+#include <libusb.h>
+
+// HID class requests
+#define HID_REQ_GET_REPORT 0x01
+#define HID_REQ_SET_REPORT 0x09
+
+// Largest report that can be queued asynchronously
+#define LIBUSB1_MAX_REPORT 1024
+
+static libusb_context* libusb1_context = NULL;
+
+// Device handle of the calling thread, so every fleet worker owns one device
+static __thread libusb_device_handle* libusb1_handle = NULL;
+
+// Asynchronous transfers that are currently queued by the calling thread.
+// Completions may be reaped by any thread, so they are updated atomically.
+typedef struct {
+    int inflight;
+    int error;
+} libusb1_async_t;
+
+static __thread libusb1_async_t libusb1_async;
+
+// Bulk OUT transfers that are queued at once without a -p option
+#define LIBUSB1_BULK_QUEUE 8
+
+// Status reads that are kept queued on the bulk IN endpoint
+#define LIBUSB1_STATUS_QUEUE 4
+#define LIBUSB1_STATUS_REPORTS 64
+
+// Optional vendor bulk interface of the calling thread. The status reads
+// resubmit themselves, their reports are collected in a ring.
+typedef struct {
+    bool claimed;
+    struct libusb_transfer* status[LIBUSB1_STATUS_QUEUE];
+    int active;
+    int error;
+    unsigned head, tail;
+    uint8_t reports[LIBUSB1_STATUS_REPORTS][HID_REPORT_SIZE];
+} libusb1_bulk_t;
+
+static __thread libusb1_bulk_t libusb1_bulk;
+
+void SecureLoader_init(void)
+{
+    if (libusb_init(&libusb1_context) < 0) {
+        die("Unable to initialize libusb\n");
+    }
+}
+
+void SecureLoader_exit(void)
+{
+    SecureLoader_close();
+    if (!libusb1_context) return;
+    libusb_exit(libusb1_context);
+    libusb1_context = NULL;
+}
+
+static libusb_device_handle* claim_usb_device(libusb_device_handle* h)
+{
+    if (!h) return NULL;
+
+    // Detach the usbhid kernel driver while we are using the device
+    libusb_set_auto_detach_kernel_driver(h, 1);
+    if (libusb_claim_interface(h, 0) < 0) {
+        libusb_close(h);
+        printf_verbose("Unable to claim interface, check USB permissions");
+        return NULL;
+    }
+
+    // The vendor bulk interface needs a libusb compatible driver (WinUSB)
+    memset(&libusb1_bulk, 0, sizeof(libusb1_bulk));
+    libusb1_bulk.claimed = (libusb_claim_interface(h, 1) == 0);
+    return h;
+}
+
+static libusb_device_handle* open_usb_device(int vid, int pid)
+{
+    return claim_usb_device(libusb_open_device_with_vid_pid(libusb1_context, vid, pid));
+}
+
+// Port path of a device, "bus-port.port.port"
+static void libusb1_device_path(libusb_device* dev, char* path, size_t size)
+{
+    uint8_t ports[8];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    int len = snprintf(path, size, "%d-", libusb_get_bus_number(dev));
+    for (int i = 0; i < n && len < (int)size; i++) {
+        len += snprintf(path + len, size - len, i ? ".%d" : "%d", ports[i]);
+    }
+}
+
+static bool libusb1_is_bootloader(libusb_device* dev)
+{
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) < 0) return false;
+    return (desc.idVendor == VENDOR_ID && desc.idProduct == PRODUCT_ID) ||
+        (desc.idVendor == 0x03eb && desc.idProduct == 0x2067);
+}
+
+int SecureLoader_open(void)
+{
+    SecureLoader_close();
+    libusb1_handle = open_usb_device(VENDOR_ID, PRODUCT_ID);
+
+    if (!libusb1_handle)
+        libusb1_handle = open_usb_device(0x03eb, 0x2067);
+
+    if (!libusb1_handle) return 0;
+    return 1;
+}
+
+int SecureLoader_enumerate(char paths[][SECURELOADER_PATH_MAX], int max)
+{
+    libusb_device** list;
+    ssize_t n = libusb_get_device_list(libusb1_context, &list);
+    if (n < 0) return 0;
+
+    int count = 0;
+    for (ssize_t i = 0; i < n && count < max; i++) {
+        if (!libusb1_is_bootloader(list[i])) continue;
+        libusb1_device_path(list[i], paths[count++], SECURELOADER_PATH_MAX);
+    }
+    libusb_free_device_list(list, 1);
+    return count;
+}
+
+int SecureLoader_open_path(const char *path)
+{
+    SecureLoader_close();
+
+    libusb_device** list;
+    ssize_t n = libusb_get_device_list(libusb1_context, &list);
+    if (n < 0) return 0;
+
+    for (ssize_t i = 0; i < n; i++) {
+        char devpath[SECURELOADER_PATH_MAX];
+        if (!libusb1_is_bootloader(list[i])) continue;
+        libusb1_device_path(list[i], devpath, sizeof(devpath));
+        if (strcmp(devpath, path)) continue;
+
+        libusb_device_handle* h;
+        if (libusb_open(list[i], &h) == 0) {
+            libusb1_handle = claim_usb_device(h);
+        }
+        break;
+    }
+    libusb_free_device_list(list, 1);
+
+    if (!libusb1_handle) return 0;
+    return 1;
+}
+
+int SecureLoader_write(void *buf, int len, double timeout)
+{
+    if (!libusb1_handle) return 0;
+
+    // Keep the order of queued pages
+    if (!SecureLoader_flush(timeout)) return 0;
+
+    // 0x0200 output report, id 0
+    int r = libusb_control_transfer(libusb1_handle, 0x21, HID_REQ_SET_REPORT, 0x0200, 0,
+        buf, len, (unsigned int)(timeout * 1000.0));
+    if (r < 0) return 0;
+    return 1;
+}
+
+int SecureLoader_read(void *buf, int len, double timeout)
+{
+    if (!libusb1_handle) return 0;
+    if (!SecureLoader_flush(timeout)) return 0;
+
+    // 0x0300 feature report, id 0
+    int r = libusb_control_transfer(libusb1_handle, 0xA1, HID_REQ_GET_REPORT, 0x0300, 0,
+        buf, len, (unsigned int)(timeout * 1000.0));
+    if (r < 0) return 0;
+    return 1;
+}
+
+int SecureLoader_interrupt_supported(void)
+{
+    return 1;
+}
+
+int SecureLoader_write_interrupt(void *buf, int len, double timeout)
+{
+    if (!libusb1_handle) return 0;
+    if (!SecureLoader_flush(timeout)) return 0;
+
+    // HID OUT endpoint 2, split into packets by libusb
+    int transferred;
+    int r = libusb_interrupt_transfer(libusb1_handle, 0x02, buf, len, &transferred,
+        (unsigned int)(timeout * 1000.0));
+    if (r < 0 || transferred != len) return 0;
+    return 1;
+}
+
+int SecureLoader_read_interrupt(void *buf, int len, double timeout)
+{
+    if (!libusb1_handle) return 0;
+
+    // HID IN endpoint 1, a timeout of 0 would wait forever in libusb
+    int transferred;
+    unsigned int ms = (unsigned int)(timeout * 1000.0);
+    int r = libusb_interrupt_transfer(libusb1_handle, 0x81, buf, len, &transferred, ms ? ms : 1);
+    if (r < 0 || transferred == 0) return 0;
+    return 1;
+}
+
+static void libusb1_transfer_done(struct libusb_transfer *transfer)
+{
+    libusb1_async_t* async = transfer->user_data;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        __atomic_store_n(&async->error, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&async->inflight, 1, __ATOMIC_RELEASE);
+    libusb_free_transfer(transfer);
+}
+
+static int libusb1_handle_events(void)
+{
+    // Another thread may reap our completions, so never block for long
+    struct timeval tv = { 0, 10000 };
+    return libusb_handle_events_timeout(libusb1_context, &tv);
+}
+
+static int libusb1_inflight(void)
+{
+    return __atomic_load_n(&libusb1_async.inflight, __ATOMIC_ACQUIRE);
+}
+
+int SecureLoader_async_supported(void)
+{
+    return 1;
+}
+
+int SecureLoader_write_async(void *buf, int len, double timeout)
+{
+    if (!libusb1_handle || libusb1_async.error) return 0;
+    if (len > LIBUSB1_MAX_REPORT) return 0;
+
+    // Wait until there is room inside the transfer window
+    while (libusb1_inflight() >= pipeline_depth) {
+        if (libusb1_handle_events() < 0) return 0;
+    }
+    if (__atomic_load_n(&libusb1_async.error, __ATOMIC_ACQUIRE)) return 0;
+
+    // The data is copied, so the caller can reuse its buffer at once
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *data = malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+    if (!transfer || !data) die("Out of memory\n");
+    libusb_fill_control_setup(data, 0x21, HID_REQ_SET_REPORT, 0x0200, 0, len);
+    memcpy(data + LIBUSB_CONTROL_SETUP_SIZE, buf, len);
+    libusb_fill_control_transfer(transfer, libusb1_handle, data,
+        libusb1_transfer_done, &libusb1_async, (unsigned int)(timeout * 1000.0));
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    __atomic_add_fetch(&libusb1_async.inflight, 1, __ATOMIC_RELEASE);
+    if (libusb_submit_transfer(transfer) < 0) {
+        __atomic_sub_fetch(&libusb1_async.inflight, 1, __ATOMIC_RELEASE);
+        libusb_free_transfer(transfer);
+        return 0;
+    }
+    return 1;
+}
+
+int SecureLoader_flush(double timeout)
+{
+    // Transfers carry their own timeout, so waiting always terminates
+    while (libusb1_inflight()) {
+        if (libusb1_handle_events() < 0) return 0;
+    }
+
+    // Report and reset the error state of the finished window
+    int error = __atomic_exchange_n(&libusb1_async.error, 0, __ATOMIC_ACQ_REL);
+    return !error;
 }
 
-static usb_dev_handle *libusb_SecureLoader_handle = NULL;
+int SecureLoader_bulk_supported(void)
+{
+    return libusb1_handle && libusb1_bulk.claimed;
+}
 
-int SecureLoader_open(void)
+static void libusb1_status_done(struct libusb_transfer *transfer)
 {
-    SecureLoader_close();
-    libusb_SecureLoader_handle = open_usb_device(VENDOR_ID, PRODUCT_ID);
+    libusb1_bulk_t* bulk = transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        // Only our own thread reads the ring, the oldest report is lost if it is full
+        unsigned head = __atomic_load_n(&bulk->head, __ATOMIC_ACQUIRE);
+        uint8_t* report = bulk->reports[head % LIBUSB1_STATUS_REPORTS];
+        memset(report, 0x00, HID_REPORT_SIZE);
+        memcpy(report, transfer->buffer, transfer->actual_length);
+        __atomic_store_n(&bulk->head, head + 1, __ATOMIC_RELEASE);
+
+        if (libusb_submit_transfer(transfer) == 0) return;
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        __atomic_store_n(&bulk->error, 1, __ATOMIC_RELEASE);
+    }
 
-    if (!libusb_SecureLoader_handle)
-        libusb_SecureLoader_handle = open_usb_device(0x03eb, 0x2067);
+    // Freed by SecureLoader_close()
+    __atomic_sub_fetch(&bulk->active, 1, __ATOMIC_RELEASE);
+}
 
-    if (!libusb_SecureLoader_handle) return 0;
+static int libusb1_start_status(void)
+{
+    if (__atomic_load_n(&libusb1_bulk.active, __ATOMIC_ACQUIRE)) return 1;
+
+    // Bulk IN endpoint 4, the reads never time out and are cancelled on close
+    for (int i = 0; i < LIBUSB1_STATUS_QUEUE; i++) {
+        struct libusb_transfer *transfer = libusb1_bulk.status[i];
+        if (!transfer) {
+            transfer = libusb_alloc_transfer(0);
+            unsigned char *data = malloc(HID_REPORT_SIZE);
+            if (!transfer || !data) die("Out of memory\n");
+            libusb_fill_bulk_transfer(transfer, libusb1_handle, 0x84, data, HID_REPORT_SIZE,
+                libusb1_status_done, &libusb1_bulk, 0);
+            transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+            libusb1_bulk.status[i] = transfer;
+        }
+        __atomic_add_fetch(&libusb1_bulk.active, 1, __ATOMIC_RELEASE);
+        if (libusb_submit_transfer(transfer) < 0) {
+            __atomic_sub_fetch(&libusb1_bulk.active, 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
     return 1;
 }
 
-int SecureLoader_write(void *buf, int len, double timeout)
+int SecureLoader_write_bulk(void *buf, int len, double timeout)
 {
-    int r;
+    if (!SecureLoader_bulk_supported() || libusb1_async.error) return 0;
+    if (len > LIBUSB1_MAX_REPORT) return 0;
+    if (!libusb1_start_status()) return 0;
+
+    // Keep several requests queued, so the device never waits for the next one
+    int depth = pipeline_depth ? pipeline_depth : LIBUSB1_BULK_QUEUE;
+    while (libusb1_inflight() >= depth) {
+        if (libusb1_handle_events() < 0) return 0;
+    }
+    if (__atomic_load_n(&libusb1_async.error, __ATOMIC_ACQUIRE)) return 0;
+
+    // Bulk OUT endpoint 3, the data is copied like in SecureLoader_write_async()
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *data = malloc(len);
+    if (!transfer || !data) die("Out of memory\n");
+    memcpy(data, buf, len);
+    libusb_fill_bulk_transfer(transfer, libusb1_handle, 0x03, data, len,
+        libusb1_transfer_done, &libusb1_async, (unsigned int)(timeout * 1000.0));
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    __atomic_add_fetch(&libusb1_async.inflight, 1, __ATOMIC_RELEASE);
+    if (libusb_submit_transfer(transfer) < 0) {
+        __atomic_sub_fetch(&libusb1_async.inflight, 1, __ATOMIC_RELEASE);
+        libusb_free_transfer(transfer);
+        return 0;
+    }
+    return 1;
+}
 
-    if (!libusb_SecureLoader_handle) return 0;
-    // 0x0100 out, 0x0200 feature
-    r = usb_control_msg(libusb_SecureLoader_handle, 0x21, 9, 0x0200, 0, (char *)buf,
-        len, (int)(timeout * 1000.0));
-    if (r < 0) return 0;
+int SecureLoader_read_bulk(void *buf, int len, double timeout)
+{
+    if (!SecureLoader_bulk_supported()) return 0;
+
+    // Without a timeout only the events that are already pending are handled
+    struct timeval zero = { 0, 0 };
+    libusb_handle_events_timeout(libusb1_context, &zero);
+
+    double end = timestamp() + timeout;
+    while (__atomic_load_n(&libusb1_bulk.head, __ATOMIC_ACQUIRE) == libusb1_bulk.tail) {
+        if (__atomic_load_n(&libusb1_bulk.error, __ATOMIC_ACQUIRE)) return 0;
+        if (timestamp() >= end) return 0;
+        if (libusb1_handle_events() < 0) return 0;
+    }
+
+    if (len > HID_REPORT_SIZE) len = HID_REPORT_SIZE;
+    memcpy(buf, libusb1_bulk.reports[libusb1_bulk.tail++ % LIBUSB1_STATUS_REPORTS], len);
     return 1;
 }
 
 void SecureLoader_close(void)
 {
-    if (!libusb_SecureLoader_handle) return;
-    usb_release_interface(libusb_SecureLoader_handle, 0);
-    usb_close(libusb_SecureLoader_handle);
-    libusb_SecureLoader_handle = NULL;
+    if (!libusb1_handle) return;
+    SecureLoader_flush(1);
+
+    // Stop the status reads of the vendor bulk interface
+    if (libusb1_bulk.claimed) {
+        for (int i = 0; i < LIBUSB1_STATUS_QUEUE; i++) {
+            if (libusb1_bulk.status[i]) libusb_cancel_transfer(libusb1_bulk.status[i]);
+        }
+        while (__atomic_load_n(&libusb1_bulk.active, __ATOMIC_ACQUIRE)) {
+            if (libusb1_handle_events() < 0) break;
+        }
+        for (int i = 0; i < LIBUSB1_STATUS_QUEUE; i++) {
+            if (libusb1_bulk.status[i]) libusb_free_transfer(libusb1_bulk.status[i]);
+        }
+        libusb_release_interface(libusb1_handle, 1);
+        memset(&libusb1_bulk, 0, sizeof(libusb1_bulk));
+    }
+    libusb_release_interface(libusb1_handle, 0);
+    libusb_close(libusb1_handle);
+    libusb1_handle = NULL;
 }
 
 #endif
@@ -424,7 +2123,8 @@ void SecureLoader_close(void)
 // http://www.signal11.us/oss/hidapi/
 #include <hidapi.h>
 
-static hid_device* hidapi_device = NULL;
+// Device handle of the calling thread, so every fleet worker owns one device
+static __thread hid_device* hidapi_device = NULL;
 
 void SecureLoader_init(void)
 {
@@ -438,6 +2138,7 @@ void SecureLoader_exit(void)
 
 int SecureLoader_open(void)
 {
+    SecureLoader_close();
     hidapi_device = hid_open(VENDOR_ID, PRODUCT_ID, NULL);
 
     if(!hidapi_device){
@@ -448,6 +2149,30 @@ int SecureLoader_open(void)
     return 1;
 }
 
+int SecureLoader_enumerate(char paths[][SECURELOADER_PATH_MAX], int max)
+{
+    const unsigned short ids[][2] = { { VENDOR_ID, PRODUCT_ID }, { 0x03eb, 0x2067 } };
+    int count = 0;
+
+    for (int i = 0; i < 2; i++) {
+        struct hid_device_info *devs = hid_enumerate(ids[i][0], ids[i][1]);
+        for (struct hid_device_info *d = devs; d && count < max; d = d->next) {
+            snprintf(paths[count++], SECURELOADER_PATH_MAX, "%s", d->path);
+        }
+        hid_free_enumeration(devs);
+    }
+    return count;
+}
+
+int SecureLoader_open_path(const char *path)
+{
+    SecureLoader_close();
+    hidapi_device = hid_open_path(path);
+
+    if (!hidapi_device) return 0;
+    return 1;
+}
+
 int SecureLoader_write(void *buf, int len, double timeout)
 {
     if (!hidapi_device) return 0;
@@ -457,13 +2182,41 @@ int SecureLoader_write(void *buf, int len, double timeout)
     newbuf[0] = 0x00;
     memcpy(newbuf + 1, buf, len);
 
-    int r = hid_write(hidapi_device, newbuf, len + 1);
-    //int r = hid_send_feature_report(hidapi_device, newbuf, len + 1);
+    // hid_write() would use the HID OUT endpoint, requests go to the control endpoint
+    int r = hid_send_feature_report(hidapi_device, newbuf, len + 1);
 
     if (r < 0) return 0;
     return 1;
 }
 
+int SecureLoader_interrupt_supported(void)
+{
+    return 1;
+}
+
+int SecureLoader_write_interrupt(void *buf, int len, double timeout)
+{
+    if (!hidapi_device) return 0;
+
+    // One output report per packet, report ID (0) added
+    for (int offset = 0; offset < len; offset += HID_REPORT_SIZE) {
+        uint8_t report[HID_REPORT_SIZE + 1] = { 0x00 };
+        int n = (len - offset < HID_REPORT_SIZE) ? len - offset : HID_REPORT_SIZE;
+        memcpy(report + 1, (uint8_t*)buf + offset, n);
+        if (hid_write(hidapi_device, report, sizeof(report)) < 0) return 0;
+    }
+    return 1;
+}
+
+int SecureLoader_read_interrupt(void *buf, int len, double timeout)
+{
+    if (!hidapi_device) return 0;
+
+    int r = hid_read_timeout(hidapi_device, buf, len, (int)(timeout * 1000.0));
+    if (r <= 0) return 0;
+    return 1;
+}
+
 int SecureLoader_read(void *buf, int len, double timeout)
 {
     if (!hidapi_device) return 0;
@@ -895,164 +2648,238 @@ void SecureLoader_close(void)
 
 /****************************************************************/
 /*                                                              */
-/*                     Read Intel Hex File                      */
+/*           USB Access - In-process Device Emulator            */
 /*                                                              */
 /****************************************************************/
 
-// the maximum flash image size we can support
-// chips with larger memory may be used, but only this
-// much intel-hex data can be loaded into memory!
-#define MAX_MEMORY_SIZE 0x10000
+#if defined(USE_EMULATOR)
 
-static unsigned char firmware_image[MAX_MEMORY_SIZE];
-static unsigned char firmware_mask[MAX_MEMORY_SIZE];
-static int end_record_seen=0;
-static int byte_count;
-static unsigned int extended_addr = 0;
-static int parse_hex_line(char *line);
+// SecureLoader.c compiled for the host, see SecureLoaderEmu.c
+#include "SecureLoaderEmu.h"
 
-int read_intel_hex(const char *filename)
-{
-    FILE *fp;
-    int i, lineno=0;
-    char buf[1024];
+#define EMULATOR_PATH "emulator"
 
-    byte_count = 0;
-    end_record_seen = 0;
-    for (i=0; i<MAX_MEMORY_SIZE; i++) {
-        firmware_image[i] = 0xFF;
-        firmware_mask[i] = 0;
-    }
-    extended_addr = 0;
+// Defaults for the ATmega32u4 at full speed, override with -E
+static Emulator_Timing_t emulator_timing = {
+    .latency = 0.001,
+    .erase = 0.004,
+    .write = 0.004,
+};
 
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-        //printf("Unable to read file %s\n", filename);
-        return -1;
-    }
-    while (!feof(fp)) {
-        *buf = '\0';
-        if (!fgets(buf, sizeof(buf), fp)) break;
-        lineno++;
-        if (*buf) {
-            if (parse_hex_line(buf) == 0) {
-                //printf("Warning, parse error line %d\n", lineno);
-                fclose(fp);
-                return -2;
-            }
-        }
-        if (end_record_seen) break;
-        if (feof(stdin)) break;
-    }
-    fclose(fp);
-    return byte_count;
-}
-
-
-/* from ihex.c, at http://www.pjrc.com/tech/8051/pm2_docs/intel-hex.html */
-
-/* parses a line of intel hex code, stores the data in bytes[] */
-/* and the beginning address in addr, and returns a 1 if the */
-/* line was valid, or a 0 if an error occurred.  The variable */
-/* num gets the number of bytes that were stored into bytes[] */
-
-
-int
-parse_hex_line(char *line)
-{
-    int addr, code, num;
-        int sum, len, cksum, i;
-        char *ptr;
-
-        num = 0;
-        if (line[0] != ':') return 0;
-        if (strlen(line) < 11) return 0;
-        ptr = line+1;
-        if (!sscanf(ptr, "%02x", &len)) return 0;
-        ptr += 2;
-        if ((int)strlen(line) < (11 + (len * 2)) ) return 0;
-        if (!sscanf(ptr, "%04x", &addr)) return 0;
-        ptr += 4;
-          /* printf("Line: length=%d Addr=%d\n", len, addr); */
-        if (!sscanf(ptr, "%02x", &code)) return 0;
-    if (addr + extended_addr + len >= MAX_MEMORY_SIZE) return 0;
-        ptr += 2;
-        sum = (len & 255) + ((addr >> 8) & 255) + (addr & 255) + (code & 255);
-    if (code != 0) {
-        if (code == 1) {
-            end_record_seen = 1;
-            return 1;
-        }
-        if (code == 2 && len == 2) {
-            if (!sscanf(ptr, "%04x", &i)) return 1;
-            ptr += 4;
-            sum += ((i >> 8) & 255) + (i & 255);
-                if (!sscanf(ptr, "%02x", &cksum)) return 1;
-            if (((sum & 255) + (cksum & 255)) & 255) return 1;
-            extended_addr = i << 4;
-            //printf("ext addr = %05X\n", extended_addr);
-        }
-        if (code == 4 && len == 2) {
-            if (!sscanf(ptr, "%04x", &i)) return 1;
-            ptr += 4;
-            sum += ((i >> 8) & 255) + (i & 255);
-                if (!sscanf(ptr, "%02x", &cksum)) return 1;
-            if (((sum & 255) + (cksum & 255)) & 255) return 1;
-            extended_addr = i << 16;
-            //printf("ext addr = %08X\n", extended_addr);
-        }
-        return 1;    // non-data line
-    }
-    byte_count += len;
-        while (num != len) {
-                if (sscanf(ptr, "%02x", &i) != 1) return 0;
-        i &= 255;
-        firmware_image[addr + extended_addr + num] = i;
-        firmware_mask[addr + extended_addr + num] = 1;
-                ptr += 2;
-                sum += i;
-                (num)++;
-                if (num >= 256) return 0;
-        }
-        if (!sscanf(ptr, "%02x", &cksum)) return 0;
-        if (((sum & 255) + (cksum & 255)) & 255) return 0; /* checksum error */
-        return 1;
-}
-
-int ihex_bytes_within_range(int begin, int end)
+// There is only one emulated device, fleet workers take turns.
+// Like interface 0 with libusb, only one handle at a time can claim it.
+static int emulator_fill = -1;
+static pthread_mutex_t emulator_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool emulator_powered = false;
+static bool emulator_claimed = false;
+static __thread bool emulator_open = false;
+
+void SecureLoader_init(void)
 {
-    int i;
+}
+
+void SecureLoader_exit(void)
+{
+    Emulator_Stats_t stats;
+
+    if (!emulator_powered) return;
+    Emulator_GetStats(&stats);
+    printf_verbose("Emulator: %u transfers, %u stalls, %u pages erased, %u pages written, %.3f s device time\n",
+        stats.transfers, stats.stalls, stats.erases, stats.writes, stats.time);
+}
 
-    if (begin < 0 || begin >= MAX_MEMORY_SIZE ||
-       end < 0 || end >= MAX_MEMORY_SIZE) {
+int SecureLoader_open(void)
+{
+    SecureLoader_close();
+    pthread_mutex_lock(&emulator_lock);
+    if (emulator_claimed) {
+        pthread_mutex_unlock(&emulator_lock);
         return 0;
     }
-    for (i=begin; i<=end; i++) {
-        if (firmware_mask[i]) return 1;
+    emulator_claimed = true;
+    if (!emulator_powered) {
+        // Blank flash with the default Bootloader Key
+        Emulator_Init(key, &emulator_timing);
+        if (emulator_fill >= 0) Emulator_FillApplication(emulator_fill);
+        emulator_powered = true;
+    }
+    else if (!Emulator_Attached()) {
+        // Reconnect after the device left the bootloader
+        Emulator_Reset();
     }
+    pthread_mutex_unlock(&emulator_lock);
+
+    emulator_open = true;
+    return 1;
+}
+
+int SecureLoader_enumerate(char paths[][SECURELOADER_PATH_MAX], int max)
+{
+    if (max < 1) return 0;
+    snprintf(paths[0], SECURELOADER_PATH_MAX, "%s", EMULATOR_PATH);
+    return 1;
+}
+
+int SecureLoader_open_path(const char *path)
+{
+    if (strcmp(path, EMULATOR_PATH)) return 0;
+    return SecureLoader_open();
+}
+
+int SecureLoader_write(void *buf, int len, double timeout)
+{
+    if (!emulator_open) return 0;
+
+    pthread_mutex_lock(&emulator_lock);
+    bool r = Emulator_SetReport(buf, len);
+    pthread_mutex_unlock(&emulator_lock);
+    return r;
+}
+
+int SecureLoader_read(void *buf, int len, double timeout)
+{
+    if (!emulator_open) return 0;
+
+    pthread_mutex_lock(&emulator_lock);
+    bool r = Emulator_GetReport(buf, len);
+    pthread_mutex_unlock(&emulator_lock);
+    return r;
+}
+
+void SecureLoader_close(void)
+{
+    if (!emulator_open) return;
+    pthread_mutex_lock(&emulator_lock);
+    emulator_claimed = false;
+    pthread_mutex_unlock(&emulator_lock);
+    emulator_open = false;
+}
+
+// "-E <latency>,<erase>,<write>" in milliseconds
+int SecureLoader_interrupt_supported(void)
+{
+    return 1;
+}
+
+int SecureLoader_write_interrupt(void *buf, int len, double timeout)
+{
+    if (!emulator_open) return 0;
+
+    pthread_mutex_lock(&emulator_lock);
+    bool r = Emulator_InterruptOut(buf, len);
+    pthread_mutex_unlock(&emulator_lock);
+    return r;
+}
+
+int SecureLoader_read_interrupt(void *buf, int len, double timeout)
+{
+    if (!emulator_open) return 0;
+
+    pthread_mutex_lock(&emulator_lock);
+    uint16_t r = Emulator_InterruptIn(buf, len);
+    pthread_mutex_unlock(&emulator_lock);
+    return r > 0;
+}
+
+static void emulator_parse_timing(const char *arg)
+{
+    double latency, erase, write;
+    int n = sscanf(arg, "%lf,%lf,%lf,%i", &latency, &erase, &write, &emulator_fill);
+
+    if (n != 3 && n != 4) usage();
+    if (latency < 0 || erase < 0 || write < 0 || emulator_fill > 0xFF) usage();
+    emulator_timing.latency = latency / 1000.0;
+    emulator_timing.erase = erase / 1000.0;
+    emulator_timing.write = write / 1000.0;
+}
+
+#endif
+
+
+
+/****************************************************************/
+/*                                                              */
+/*            USB Access - Synchronous Fallback                 */
+/*                                                              */
+/****************************************************************/
+
+#if !defined(USE_LIBUSB1)
+
+// Backends without asynchronous transfers write every page directly
+int SecureLoader_async_supported(void)
+{
     return 0;
 }
 
-void ihex_get_data(int addr, int len, unsigned char *bytes)
+int SecureLoader_write_async(void *buf, int len, double timeout)
 {
-    int i;
+    return SecureLoader_write(buf, len, timeout);
+}
 
-    if (addr < 0 || len < 0 || addr + len >= MAX_MEMORY_SIZE) {
-        for (i=0; i<len; i++) {
-            bytes[i] = 255;
-        }
-        return;
-    }
-    for (i=0; i<len; i++) {
-        if (firmware_mask[addr]) {
-            bytes[i] = firmware_image[addr];
-        } else {
-            bytes[i] = 255;
-        }
-        addr++;
-    }
+int SecureLoader_flush(double timeout)
+{
+    return 1;
+}
+
+#endif
+
+#if !defined(USE_HIDAPI) && !defined(USE_LIBUSB1) && !defined(USE_EMULATOR)
+
+// Backends without HID OUT endpoint access send pages as control transfers
+int SecureLoader_interrupt_supported(void)
+{
+    return 0;
+}
+
+int SecureLoader_write_interrupt(void *buf, int len, double timeout)
+{
+    return 0;
+}
+
+int SecureLoader_read_interrupt(void *buf, int len, double timeout)
+{
+    return 0;
+}
+
+#endif
+
+#if !defined(USE_LIBUSB1)
+
+// The vendor bulk interface is only used through libusb-1.0
+int SecureLoader_bulk_supported(void)
+{
+    return 0;
+}
+
+int SecureLoader_write_bulk(void *buf, int len, double timeout)
+{
+    return 0;
+}
+
+int SecureLoader_read_bulk(void *buf, int len, double timeout)
+{
+    return 0;
+}
+
+#endif
+
+#if !defined(USE_HIDAPI) && !defined(USE_LIBUSB1) && !defined(USE_EMULATOR)
+
+// Addressing devices by path is only supported by hidapi and libusb-1.0
+int SecureLoader_enumerate(char paths[][SECURELOADER_PATH_MAX], int max)
+{
+    return 0;
+}
+
+int SecureLoader_open_path(const char *path)
+{
+    return 0;
 }
 
+#endif
+
+
+
 /****************************************************************/
 /*                                                              */
 /*                       Misc Functions                         */
@@ -1089,7 +2916,7 @@ int printf_high_verbose(const char *format, ...)
     return r;
 }
 
-void hexdump(uint8_t * data, size_t len)
+void hexdump(const uint8_t * data, size_t len)
 {
     size_t i;
     for (i = 0; i < len; i++) {
@@ -1101,6 +2928,130 @@ void hexdump(uint8_t * data, size_t len)
     printf_verbose("\n");
 }
 
+double timestamp(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+typedef struct {
+    void (*job)(void *arg, int index);
+    void *arg;
+    int count;
+    int next;
+} parallel_t;
+
+static void* parallel_worker(void *p)
+{
+    parallel_t *parallel = p;
+
+    // Every worker takes the next free index until all jobs are done
+    int index;
+    while ((index = __atomic_fetch_add(&parallel->next, 1, __ATOMIC_RELAXED)) < parallel->count) {
+        parallel->job(parallel->arg, index);
+    }
+    return NULL;
+}
+
+void run_parallel(int count, int threads, void (*job)(void *arg, int index), void *arg)
+{
+    parallel_t parallel = { .job = job, .arg = arg, .count = count, .next = 0 };
+    pthread_t workers[threads];
+
+    if (threads > count) threads = count;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, parallel_worker, &parallel)) {
+            die("Unable to create worker thread\n");
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+int parse_key(const char *hex, uint8_t *key)
+{
+    // 64 hex digits, 256 bit key, or 32 hex digits, 128 bit key zero padded
+    size_t len = strlen(hex) / 2;
+    if (strlen(hex) != 64 && strlen(hex) != 32) return 0;
+    memset(key, 0, 32);
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return 0;
+        key[i] = byte;
+    }
+    return 1;
+}
+
+void random_bytes(uint8_t *buf, size_t len)
+{
+    // Prefer the system random source, rand() is not seeded
+    FILE *fp = fopen("/dev/urandom", "rb");
+    size_t n = 0;
+    if (fp) {
+        n = fread(buf, 1, len, fp);
+        fclose(fp);
+    }
+    while (n < len) buf[n++] = rand();
+}
+
+uint16_t crc16(const uint8_t *data, size_t len)
+{
+    // Same as _crc16_update() of avr-libc, starting with 0xFFFF
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+static int blank_run(const uint8_t *data, int len)
+{
+    // Length of the 0x00 or 0xFF run at the start of data
+    int n = 0;
+    if (data[0] != 0x00 && data[0] != 0xFF) return 0;
+    while (n < len && n < COMPRESSED_RUN_MAX && data[n] == data[0]) n++;
+    return n;
+}
+
+int compress_pages(const uint8_t *data, int pages, uint8_t *out)
+{
+    // Runs of 0x00 and 0xFF and literals, see ProgrammFlashPages_t.
+    // Returns 0 if the tokens are not shorter than the pages.
+    int size = pages * SPM_PAGESIZE;
+    int len = 0;
+    for (int page = 0; page < size; page += SPM_PAGESIZE) {
+        int offset = 0;
+        while (offset < SPM_PAGESIZE) {
+            const uint8_t *p = &data[page + offset];
+            int left = SPM_PAGESIZE - offset;
+
+            // A run of two does not pay off if it splits a literal
+            int run = blank_run(p, left);
+            if (run >= 3 || run == left) {
+                if (len + 1 >= size) return 0;
+                out[len++] = COMPRESSED_RUN | ((p[0] == 0xFF) ? COMPRESSED_RUN_FF : 0) | (run - 1);
+                offset += run;
+                continue;
+            }
+
+            // Literal up to the next worthwhile run
+            int n = 1;
+            while (n < left && n < COMPRESSED_LITERAL_MAX && blank_run(p + n, left - n) < 3) n++;
+            if (len + 1 + n >= size) return 0;
+            out[len++] = n - 1;
+            memcpy(&out[len], p, n);
+            len += n;
+            offset += n;
+        }
+    }
+    return len;
+}
+
 void delay(double seconds)
 {
     #ifdef USE_WIN32
@@ -1115,6 +3066,15 @@ void die(const char *str, ...)
     va_list  ap;
 
     va_start(ap, str);
+
+    // Fleet workers only fail their own device
+    if (die_handler) {
+        vsnprintf(die_message, sizeof(((fleet_device_t*)0)->error), str, ap);
+        die_message[strcspn(die_message, "\n")] = '\0';
+        va_end(ap);
+        longjmp(*die_handler, 1);
+    }
+
     vfprintf(stderr, str, ap);
     fprintf(stderr, "\n");
     va_end(ap);
@@ -1141,11 +3101,57 @@ void parse_options(int argc, char **argv)
                 wait_for_device_to_appear = 1;
             } else if (strcmp(arg, "-n") == 0) {
                 reboot_after_programming = 0;
+            } else if (strncmp(arg, "-p", 2) == 0) {
+                pipeline_depth = PIPELINE_DEPTH;
+                if (arg[2]) pipeline_depth = atoi(arg + 2);
+                if (pipeline_depth < 1) usage();
+                if (!SecureLoader_async_supported()) {
+                    die("Pipelined upload (-p) needs asynchronous transfers, only the libusb-1.0 build has them.\n"
+                        "Build SecureLoaderCli with USE_LIBUSB1, see the Makefile.\n");
+                }
+            } else if (strcmp(arg, "-u") == 0) {
+                delta_update = 1;
+            } else if (strcmp(arg, "-c") == 0) {
+                control_transfers_only = 1;
+            } else if (strcmp(arg, "-i") == 0) {
+                hid_out_endpoint = 1;
+            } else if (strcmp(arg, "-s") == 0) {
+                device_verify_only = 1;
+            } else if (strcmp(arg, "-a") == 0) {
+                fleet_all_devices = 1;
+            } else if (strcmp(arg, "-d") == 0 && i + 1 < argc) {
+                fleet_add_device(argv[++i]);
+            } else if (strcmp(arg, "-k") == 0 && i + 1 < argc) {
+                fleet_keyfile = argv[++i];
+            } else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+                fleet_threads = atoi(argv[++i]);
+                if (fleet_threads < 1) usage();
+            } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+                package_output = argv[++i];
+            } else if (strcmp(arg, "-b") == 0 && i + 1 < argc) {
+                key_bits = atoi(argv[++i]);
+                if (key_bits != 128 && key_bits != 256) usage();
+            } else if (strcmp(arg, "-K") == 0 && i + 1 < argc) {
+                sign_key = argv[++i];
+            } else if (strcmp(arg, "-N") == 0 && i + 1 < argc) {
+                new_key = argv[++i];
+            } else if (strcmp(arg, "-A") == 0) {
+                package_authenticate = 0;
+            } else if (strcmp(arg, "-M") == 0 && i + 1 < argc) {
+                master_key = argv[++i];
+            } else if (strcmp(arg, "-S") == 0 && i + 1 < argc) {
+                serial_file = argv[++i];
+#if defined(USE_EMULATOR)
+            } else if (strcmp(arg, "-E") == 0 && i + 1 < argc) {
+                emulator_parse_timing(argv[++i]);
+#endif
             } else if (strcmp(arg, "-v") == 0) {
                 verbose = 1;
             } else if (strcmp(arg, "-vv") == 0) {
                     verbose = 2;
             }
+        } else if (i == 1 && (!strcmp(arg, "sign") || !strcmp(arg, "flash"))) {
+            command = arg;
         } else {
             filename = argv[i];
         }
@@ -0,0 +1,335 @@
+// In-process SecureLoader device for host side benchmarks and tests.
+// The bootloader sources are compiled unchanged, the headers in emulator/
+// replace avr-libc and LUFA with a simulated flash and control endpoint.
+// Build with -Iemulator -DAES256_HOST, see the emulator target of the Makefile.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "SecureLoaderEmu.h"
+
+// Settings of the bootloader makefile
+#ifndef BOOT_START_ADDR
+#define BOOT_START_ADDR 0x7000
+#endif
+#ifndef BAUD
+#define BAUD 115200
+#endif
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+// The size check only matters for the AVR build
+#if !defined(__OPTIMIZE_SIZE__)
+#define __OPTIMIZE_SIZE__ 1
+#endif
+
+// The bootloader main() never runs, requests are dispatched directly
+#define main SecureLoader_main
+#include "../SecureLoader.c"
+#include "../BootloaderAPI.c"
+#undef main
+
+// Emulated memories and registers used by the stub headers
+uint8_t Emulator_Flash[FLASHEND + 1];
+uint8_t Emulator_EEPROM[E2END + 1];
+uint8_t Emulator_SRAM[RAMSIZE];
+volatile uint8_t Emulator_IO[8];
+volatile uint16_t Emulator_IO16[2];
+
+USB_Request_Header_t USB_ControlRequest;
+Emulator_ControlTransfer_t Emulator_ControlTransfer;
+Emulator_OUTEndpoint_t Emulator_OUTEndpoint;
+uint8_t Emulator_SelectedEndpoint;
+
+// SPM temporary page buffer, erased after every page write
+static uint16_t Emulator_PageBuffer[SPM_PAGESIZE / 2];
+static bool Emulator_PageBufferFilled[SPM_PAGESIZE / 2];
+
+// Reports of the HID IN endpoint, the host kernel queues them the same way
+#define EMULATOR_IN_REPORTS 64
+static uint8_t Emulator_INReports[EMULATOR_IN_REPORTS][HID_IN_EPSIZE];
+static unsigned Emulator_INHead, Emulator_INTail;
+static uint8_t Emulator_INLength;
+
+static Emulator_Timing_t Emulator_Timing;
+static Emulator_Stats_t Emulator_Stats;
+
+// End of the running erase or write, the CPU keeps running meanwhile
+static double Emulator_SPMDone;
+static bool Emulator_SPMErased;
+
+
+/****************************************************************/
+/*                                                              */
+/*                      Simulated Hardware                      */
+/*                                                              */
+/****************************************************************/
+
+static double Emulator_Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Emulator_Wait(double until)
+{
+    // Busy wait, sleeping is too coarse for sub millisecond latencies
+    while (Emulator_Now() < until);
+}
+
+static void Emulator_Delay(double seconds)
+{
+    Emulator_Stats.time += seconds;
+    if (seconds > 0) Emulator_Wait(Emulator_Now() + seconds);
+}
+
+bool boot_spm_busy(void)
+{
+    return Emulator_Now() < Emulator_SPMDone;
+}
+
+void boot_spm_busy_wait(void)
+{
+    Emulator_Wait(Emulator_SPMDone);
+}
+
+void Emulator_EndpointWrite(uint8_t data)
+{
+    if (Emulator_INLength < HID_IN_EPSIZE)
+    {
+        Emulator_INReports[Emulator_INHead % EMULATOR_IN_REPORTS][Emulator_INLength++] = data;
+    }
+}
+
+void Emulator_EndpointClearIN(void)
+{
+    // The oldest report is lost if the host does not read them
+    Emulator_INHead++;
+    if (Emulator_INHead - Emulator_INTail > EMULATOR_IN_REPORTS)
+    {
+        Emulator_INTail++;
+    }
+    Emulator_INLength = 0;
+}
+
+void boot_page_erase(uint32_t address)
+{
+    memset(&Emulator_Flash[address & FLASHEND & ~(SPM_PAGESIZE - 1)], 0xFF, SPM_PAGESIZE);
+    Emulator_Stats.erases++;
+    Emulator_Stats.time += Emulator_Timing.erase;
+    Emulator_SPMDone = Emulator_Now() + Emulator_Timing.erase;
+    Emulator_SPMErased = true;
+}
+
+void boot_page_fill(uint32_t address, uint16_t data)
+{
+    // The page buffer still belongs to the running write
+    if (boot_spm_busy()) {
+        fprintf(stderr, "Emulator: page buffer filled while SPM is busy\n");
+        abort();
+    }
+    // Every word can only be written once until the page buffer is erased
+    unsigned word = (address & (SPM_PAGESIZE - 1)) / 2;
+    if (Emulator_PageBufferFilled[word]) {
+        fprintf(stderr, "Emulator: page buffer word 0x%04X filled twice\n", (unsigned)address);
+        abort();
+    }
+    Emulator_PageBuffer[word] = data;
+    Emulator_PageBufferFilled[word] = true;
+}
+
+void boot_rww_enable(void)
+{
+    if (boot_spm_busy()) {
+        fprintf(stderr, "Emulator: RWW section enabled while SPM is busy\n");
+        abort();
+    }
+
+    // Also discards a partly filled page buffer
+    memset(Emulator_PageBuffer, 0xFF, sizeof(Emulator_PageBuffer));
+    memset(Emulator_PageBufferFilled, 0, sizeof(Emulator_PageBufferFilled));
+}
+
+void boot_page_write(uint32_t address)
+{
+    // The datasheet requires an erase before every write, a second write is undefined
+    uint8_t* page = &Emulator_Flash[address & FLASHEND & ~(SPM_PAGESIZE - 1)];
+    for (int i = 0; i < SPM_PAGESIZE; i++) {
+        if (page[i] != 0xFF) {
+            fprintf(stderr, "Emulator: page 0x%04X written without an erase\n", (unsigned)(address & FLASHEND));
+            abort();
+        }
+    }
+    for (int i = 0; i < SPM_PAGESIZE / 2; i++) {
+        page[2 * i] = Emulator_PageBuffer[i];
+        page[2 * i + 1] = Emulator_PageBuffer[i] >> 8;
+    }
+    memset(Emulator_PageBuffer, 0xFF, sizeof(Emulator_PageBuffer));
+    memset(Emulator_PageBufferFilled, 0, sizeof(Emulator_PageBufferFilled));
+    Emulator_Stats.writes++;
+    Emulator_Stats.time += Emulator_Timing.write;
+
+    // The main loop would have started the write right when the erase finished
+    double start = Emulator_SPMErased ? Emulator_SPMDone : Emulator_Now();
+    Emulator_SPMDone = start + Emulator_Timing.write;
+    Emulator_SPMErased = false;
+}
+
+
+/****************************************************************/
+/*                                                              */
+/*                      Emulator Interface                      */
+/*                                                              */
+/****************************************************************/
+
+void Emulator_Init(const uint8_t* key, const Emulator_Timing_t* timing)
+{
+    // Blank device with only the Bootloader Key in the SBS
+    memset(Emulator_Flash, 0xFF, sizeof(Emulator_Flash));
+    memset(Emulator_EEPROM, 0xFF, sizeof(Emulator_EEPROM));
+    memcpy(&Emulator_Flash[FLASHEND - 2 * SPM_PAGESIZE + 1 + offsetof(secureBootloaderSection_t, BootloaderKey)],
+        key, sizeof(SBS.BootloaderKey));
+
+    memset(&Emulator_Stats, 0, sizeof(Emulator_Stats));
+    if (timing) Emulator_Timing = *timing;
+    Emulator_Reset();
+}
+
+void Emulator_FillApplication(uint8_t value)
+{
+    // Old firmware in the application section, pages have to be erased before they are rewritten
+    memset(Emulator_Flash, value, BOOT_START_ADDR);
+}
+
+void Emulator_Reset(void)
+{
+    // Power on state of the RAM, flash and EEPROM are kept
+    memset(&ProgrammFlashPage, 0, sizeof(ProgrammFlashPage));
+    memset(ReadFlashPage.raw, 0, sizeof(ReadFlashPage));
+    memset(newBootloaderKey.raw, 0, sizeof(newBootloaderKey));
+    memset(authenticateBootloader.raw, 0, sizeof(authenticateBootloader));
+    memset(FlashDigest.raw, 0, sizeof(FlashDigest));
+    memset(PageChecksums.raw, 0, sizeof(PageChecksums));
+    memset(VerifyStatus.raw, 0, sizeof(VerifyStatus));
+    memset(Emulator_PageBuffer, 0xFF, sizeof(Emulator_PageBuffer));
+    memset(Emulator_PageBufferFilled, 0, sizeof(Emulator_PageBufferFilled));
+    Emulator_INHead = Emulator_INTail = 0;
+    Emulator_INLength = 0;
+    SetFlashPage.PageAddress = 0xFFFF;
+    memset(&HIDOUTState, 0, sizeof(HIDOUTState));
+    memset(&Emulator_OUTEndpoint, 0, sizeof(Emulator_OUTEndpoint));
+    Emulator_SelectedEndpoint = ENDPOINT_CONTROLEP;
+    memset(&BackgroundSPM, 0, sizeof(BackgroundSPM));
+    Emulator_SPMDone = 0;
+    Emulator_SPMErased = false;
+    RunBootloader = true;
+    CheckButton = 0;
+
+    // The brute force delay ran out before the host sends the first request
+    TIFR1 = (1 << OCF1A);
+
+    // What the .init5 and .init7 sections do on the AVR
+    readSBS();
+    initAES();
+}
+
+bool Emulator_Attached(void)
+{
+    // The device detaches once it leaves the bootloader
+    return RunBootloader;
+}
+
+static bool Emulator_ControlRequest(uint8_t bRequest, uint8_t ReportType, uint8_t* data, uint16_t len)
+{
+    if (!RunBootloader) return false;
+
+    Emulator_Stats.transfers++;
+    Emulator_Delay(Emulator_Timing.latency);
+
+    USB_ControlRequest.bmRequestType = (bRequest == HID_REQ_GetReport) ? 0xA1 : 0x21;
+    USB_ControlRequest.bRequest = bRequest;
+    USB_ControlRequest.wValue = (uint16_t)ReportType << 8;
+    USB_ControlRequest.wIndex = 0;
+    USB_ControlRequest.wLength = len;
+
+    Emulator_ControlTransfer.Data = data;
+    Emulator_ControlTransfer.Length = (bRequest == HID_REQ_SetReport) ? len : 0;
+    Emulator_ControlTransfer.Position = 0;
+    Emulator_ControlTransfer.Packet = 0;
+    Emulator_ControlTransfer.Stalled = false;
+    Emulator_ControlTransfer.Completed = false;
+    Emulator_SelectedEndpoint = ENDPOINT_CONTROLEP;
+
+    // What the main loop did since the last request
+    while (!ProcessSPM() && !boot_spm_busy());
+
+    EVENT_USB_Device_ControlRequest();
+
+    // The bootloader finishes programming before it detaches
+    if (!RunBootloader) FinishSPM();
+
+    if (Emulator_ControlTransfer.Stalled) Emulator_Stats.stalls++;
+    return Emulator_ControlTransfer.Completed && !Emulator_ControlTransfer.Stalled;
+}
+
+bool Emulator_SetReport(const void* buf, uint16_t len)
+{
+    // The request handler may modify the data stage in place
+    uint8_t data[len];
+    memcpy(data, buf, len);
+    return Emulator_ControlRequest(HID_REQ_SetReport, HID_REPORT_REQUEST_Out, data, len);
+}
+
+bool Emulator_GetReport(void* buf, uint16_t len)
+{
+    memset(buf, 0x00, len);
+    return Emulator_ControlRequest(HID_REQ_GetReport, HID_REPORT_REQUEST_Feature, buf, len);
+}
+
+bool Emulator_InterruptOut(const void* buf, uint16_t len)
+{
+    if (!RunBootloader) return false;
+
+    // One frame per packet, the data waits in the endpoint banks until the main loop reads it
+    uint16_t packets = (len + HID_OUT_EPSIZE - 1) / HID_OUT_EPSIZE;
+    if (packets > EMULATOR_OUT_PACKETS - (Emulator_OUTEndpoint.Head - Emulator_OUTEndpoint.Tail)) return false;
+    Emulator_Stats.transfers += packets;
+    Emulator_Delay(Emulator_Timing.latency * packets);
+
+    for (uint16_t i = 0; i < packets; i++)
+    {
+        uint16_t length = (len - i * HID_OUT_EPSIZE < HID_OUT_EPSIZE) ? len - i * HID_OUT_EPSIZE : HID_OUT_EPSIZE;
+        unsigned packet = Emulator_OUTEndpoint.Head++ % EMULATOR_OUT_PACKETS;
+        memcpy(Emulator_OUTEndpoint.Data[packet], (const uint8_t*)buf + i * HID_OUT_EPSIZE, length);
+        Emulator_OUTEndpoint.Length[packet] = length;
+    }
+
+    // What the main loop does until all packets are read and the status is sent.
+    // A request the host did not send completely waits for the next packets.
+    while (RunBootloader && ((Emulator_OUTEndpoint.Tail != Emulator_OUTEndpoint.Head) || HIDOUTState.StatusPending))
+    {
+        while (!ProcessSPM() && !boot_spm_busy());
+        ProcessOUTEndpoint(HID_OUT_EPADDR, HID_IN_EPADDR, &HIDOUTState);
+    }
+
+    if (!RunBootloader) FinishSPM();
+    return true;
+}
+
+uint16_t Emulator_InterruptIn(void* buf, uint16_t len)
+{
+    if (Emulator_INTail == Emulator_INHead) return 0;
+
+    if (len > HID_IN_EPSIZE) len = HID_IN_EPSIZE;
+    memcpy(buf, Emulator_INReports[Emulator_INTail++ % EMULATOR_IN_REPORTS], len);
+    return len;
+}
+
+void Emulator_GetStats(Emulator_Stats_t* stats)
+{
+    *stats = Emulator_Stats;
+}
@@ -0,0 +1,36 @@
+#ifndef _SECURELOADER_EMU_H_
+#define _SECURELOADER_EMU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// In-process SecureLoader device. SecureLoaderEmu.c compiles the bootloader
+// sources against the host stubs in emulator/, so the host talks to the
+// real request handling, only USB and flash are simulated.
+
+// Simulated times in seconds, spent on the host CPU
+typedef struct {
+    double latency;     // per control transfer or HID OUT packet
+    double erase;       // per flash page erase
+    double write;       // per flash page write
+} Emulator_Timing_t;
+
+typedef struct {
+    unsigned transfers;
+    unsigned erases;
+    unsigned writes;
+    unsigned stalls;
+    double time;        // total simulated time
+} Emulator_Stats_t;
+
+void Emulator_Init(const uint8_t* key, const Emulator_Timing_t* timing);
+void Emulator_Reset(void);
+void Emulator_FillApplication(uint8_t value);
+bool Emulator_Attached(void);
+bool Emulator_SetReport(const void* buf, uint16_t len);
+bool Emulator_GetReport(void* buf, uint16_t len);
+bool Emulator_InterruptOut(const void* buf, uint16_t len);
+uint16_t Emulator_InterruptIn(void* buf, uint16_t len);
+void Emulator_GetStats(Emulator_Stats_t* stats);
+
+#endif
@@ -0,0 +1,146 @@
+// Emulator cases that SecureLoaderCli can not produce, run by make emulator-test.
+// Every case starts with a blank device and prints what went wrong.
+
+#define SPM_PAGESIZE 128
+#define HID_REPORT_SIZE 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../AES/aes256_cbc.h"
+#include "../Protocol.h"
+#include "SecureLoaderEmu.h"
+
+extern uint8_t Emulator_Flash[];
+
+static const uint8_t key[32] = {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+    0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+};
+
+static int failures;
+
+static void check(bool ok, const char* name, const char* what)
+{
+    if (!ok) {
+        printf("%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+static void start(void)
+{
+    Emulator_Timing_t timing = { 0 };
+    Emulator_Init(key, &timing);
+}
+
+// A signed single page request, zero padded to full reports
+static int signPage(uint8_t* request, uint16_t address, uint8_t fill, bool wrongMac)
+{
+    aes256_ctx_t ctx;
+    int len = PROGRAMM_FLASH_PAGES_LENGTH(1);
+
+    memset(request, 0x00, 3 * HID_REPORT_SIZE);
+    request[0] = address;
+    request[1] = address >> 8;
+    memset(&request[AES256_CBC_LENGTH], fill, SPM_PAGESIZE);
+    aes256_init_key(&ctx, key, sizeof(key));
+    aes256CbcMacCalculate(&ctx, request, len - AES256_CBC_LENGTH);
+    if (wrongMac) request[len - 1] ^= 0x01;
+    return (len + HID_REPORT_SIZE - 1) / HID_REPORT_SIZE * HID_REPORT_SIZE;
+}
+
+static int readStatus(ProgrammStatus_t* status)
+{
+    uint8_t report[HID_REPORT_SIZE];
+    int reports = 0;
+    while (Emulator_InterruptIn(report, sizeof(report))) {
+        memcpy(status, report, sizeof(*status));
+        reports++;
+    }
+    return reports;
+}
+
+static bool pageIs(uint16_t address, uint8_t fill)
+{
+    // A control request lets the main loop finish the background write first
+    BootloaderCapabilities_t capabilities;
+    Emulator_GetReport(capabilities.raw, sizeof(capabilities));
+
+    for (int i = 0; i < SPM_PAGESIZE; i++) {
+        if (Emulator_Flash[address + i] != fill) return false;
+    }
+    return true;
+}
+
+// The rest of a request may arrive in a later transfer, the main loop keeps running meanwhile
+static void testTruncatedRequest(void)
+{
+    const char* name = "truncated request";
+    uint8_t request[3 * HID_REPORT_SIZE];
+    ProgrammStatus_t status;
+
+    start();
+    int len = signPage(request, 0x0100, 0x5A, false);
+    check(Emulator_InterruptOut(request, 2 * HID_REPORT_SIZE), name, "first packets not taken");
+    check(Emulator_Attached(), name, "device left the bootloader");
+    check(readStatus(&status) == 0, name, "status before the request was complete");
+
+    check(Emulator_InterruptOut(&request[2 * HID_REPORT_SIZE], len - 2 * HID_REPORT_SIZE), name, "last packet not taken");
+    check(readStatus(&status) == 1 && status.Status == PROGRAMM_STATUS_OK, name, "no OK status");
+    check(pageIs(0x0100, 0x5A), name, "page not written");
+}
+
+// A control request gives up the truncated request, the page buffer is free again
+static void testAbandonedRequest(void)
+{
+    const char* name = "abandoned request";
+    uint8_t request[3 * HID_REPORT_SIZE];
+    ProgrammStatus_t status;
+
+    start();
+    signPage(request, 0x0100, 0x5A, false);
+    check(Emulator_InterruptOut(request, HID_REPORT_SIZE + 16), name, "first packets not taken");
+    check(readStatus(&status) == 0, name, "status before the request was complete");
+
+    signPage(request, 0x0200, 0xA5, false);
+    check(Emulator_SetReport(request, PROGRAMM_FLASH_PAGES_LENGTH(1)), name, "control request failed");
+    check(pageIs(0x0200, 0xA5), name, "control page not written");
+    check(pageIs(0x0100, 0xFF), name, "abandoned page written");
+
+    int len = signPage(request, 0x0300, 0x3C, false);
+    check(Emulator_InterruptOut(request, len), name, "next request not taken");
+    check(readStatus(&status) == 1 && status.Status == PROGRAMM_STATUS_OK, name, "no OK status for the next request");
+    check(pageIs(0x0300, 0x3C), name, "next page not written");
+}
+
+// The host is told about a wrong CBC-MAC before the bootloader exits
+static void testMacError(void)
+{
+    const char* name = "CBC-MAC error";
+    uint8_t request[3 * HID_REPORT_SIZE];
+    ProgrammStatus_t status;
+
+    start();
+    int len = signPage(request, 0x0100, 0x5A, true);
+    Emulator_InterruptOut(request, len);
+    check(readStatus(&status) == 1 && status.Status == PROGRAMM_STATUS_MAC_ERROR, name, "no MAC error status");
+    check(!Emulator_Attached(), name, "device did not leave the bootloader");
+    check(pageIs(0x0100, 0xFF), name, "page written");
+}
+
+int main(void)
+{
+    testTruncatedRequest();
+    testAbandonedRequest();
+    testMacError();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All emulator cases passed\n");
+    return 0;
+}
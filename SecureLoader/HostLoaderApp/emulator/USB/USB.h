@@ -0,0 +1,238 @@
+// Host stand-in for the LUFA USB driver. The emulator fills USB_ControlRequest
+// and the data stage, then calls EVENT_USB_Device_ControlRequest() directly.
+// HID OUT endpoint packets wait in their own FIFO until the main loop reads them.
+#ifndef _EMULATOR_USB_H_
+#define _EMULATOR_USB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/delay.h>
+
+#define ATTR_NO_INIT
+#define ATTR_INIT_SECTION(section)
+#define ATTR_NO_RETURN __attribute__ ((noreturn))
+#define GlobalInterruptEnable() do { } while (0)
+#define GlobalInterruptDisable() do { } while (0)
+#define TIMING_PIN_TOGGLE() do { } while (0)
+
+#define ENDPOINT_CONTROLEP  0
+#define HID_IN_EPADDR       (0x80 | 1)
+#define HID_IN_EPSIZE       64
+#define HID_OUT_EPADDR      (0x00 | 2)
+#define HID_OUT_EPSIZE      64
+
+enum HID_ClassRequests_t
+{
+    HID_REQ_GetReport       = 0x01,
+    HID_REQ_SetReport       = 0x09,
+};
+
+enum HID_ReportItemTypes_t
+{
+    HID_REPORT_REQUEST_In      = 1,
+    HID_REPORT_REQUEST_Out     = 2,
+    HID_REPORT_REQUEST_Feature = 3,
+};
+
+typedef struct
+{
+    uint8_t  bmRequestType;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} USB_Request_Header_t;
+
+// State of the current control transfer, owned by SecureLoaderEmu.c
+typedef struct
+{
+    uint8_t* Data;
+    uint16_t Length;
+    uint16_t Position;
+    uint16_t Packet;
+    bool Stalled;
+    bool Completed;
+} Emulator_ControlTransfer_t;
+
+// Packets sent to the HID OUT endpoint, the device releases them one by one
+#define EMULATOR_OUT_PACKETS 64
+typedef struct
+{
+    uint8_t Data[EMULATOR_OUT_PACKETS][HID_OUT_EPSIZE];
+    uint8_t Length[EMULATOR_OUT_PACKETS];
+    unsigned Head;
+    unsigned Tail;
+    uint8_t Position;
+} Emulator_OUTEndpoint_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+extern Emulator_ControlTransfer_t Emulator_ControlTransfer;
+extern Emulator_OUTEndpoint_t Emulator_OUTEndpoint;
+extern uint8_t Emulator_SelectedEndpoint;
+
+// HID IN endpoint reports, queued by SecureLoaderEmu.c
+void Emulator_EndpointWrite(uint8_t data);
+void Emulator_EndpointClearIN(void);
+
+static inline void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+    Emulator_SelectedEndpoint = Address;
+}
+
+static inline bool Endpoint_IsOUTReceived(void)
+{
+    if (Emulator_SelectedEndpoint == HID_OUT_EPADDR)
+    {
+        return Emulator_OUTEndpoint.Tail != Emulator_OUTEndpoint.Head;
+    }
+    return Emulator_ControlTransfer.Packet < Emulator_ControlTransfer.Length;
+}
+
+static inline uint16_t Endpoint_BytesInEndpoint(void)
+{
+    if (Emulator_SelectedEndpoint == HID_OUT_EPADDR)
+    {
+        if (Emulator_OUTEndpoint.Tail == Emulator_OUTEndpoint.Head)
+        {
+            return 0;
+        }
+        return Emulator_OUTEndpoint.Length[Emulator_OUTEndpoint.Tail % EMULATOR_OUT_PACKETS] - Emulator_OUTEndpoint.Position;
+    }
+
+    uint16_t End = Emulator_ControlTransfer.Packet + HID_OUT_EPSIZE;
+    if (End > Emulator_ControlTransfer.Length)
+    {
+        End = Emulator_ControlTransfer.Length;
+    }
+    return (Emulator_ControlTransfer.Position < End) ? End - Emulator_ControlTransfer.Position : 0;
+}
+
+static inline uint8_t Endpoint_Read_8(void)
+{
+    // Only the HID OUT endpoint is read byte by byte
+    if ((Emulator_SelectedEndpoint != HID_OUT_EPADDR) || !Endpoint_BytesInEndpoint())
+    {
+        fprintf(stderr, "Emulator: read from an empty endpoint bank\n");
+        abort();
+    }
+    return Emulator_OUTEndpoint.Data[Emulator_OUTEndpoint.Tail % EMULATOR_OUT_PACKETS][Emulator_OUTEndpoint.Position++];
+}
+
+static inline uint8_t Endpoint_GetBusyBanks(void)
+{
+    // The host takes every IN packet right away
+    return 0;
+}
+
+static inline bool Endpoint_IsINReady(void)
+{
+    return true;
+}
+
+static inline void Endpoint_Write_8(const uint8_t Data)
+{
+    Emulator_EndpointWrite(Data);
+}
+
+static inline void Endpoint_ClearIN(void)
+{
+    Emulator_EndpointClearIN();
+}
+
+static inline void Endpoint_ClearSETUP(void)
+{
+}
+
+static inline void Endpoint_StallTransaction(void)
+{
+    Emulator_ControlTransfer.Stalled = true;
+}
+
+static inline void Endpoint_ClearStatusStageDeviceToHost(void)
+{
+    Emulator_ControlTransfer.Completed = true;
+}
+
+static inline void Endpoint_ClearStatusStageHostToDevice(void)
+{
+    Emulator_ControlTransfer.Completed = true;
+}
+
+static inline void Endpoint_ClearOUT(void)
+{
+    // Release the current packet, unread bytes are discarded
+    if (Emulator_SelectedEndpoint == HID_OUT_EPADDR)
+    {
+        if (Emulator_OUTEndpoint.Tail != Emulator_OUTEndpoint.Head)
+        {
+            Emulator_OUTEndpoint.Tail++;
+        }
+        Emulator_OUTEndpoint.Position = 0;
+        return;
+    }
+    Emulator_ControlTransfer.Packet += HID_OUT_EPSIZE;
+    Emulator_ControlTransfer.Position = Emulator_ControlTransfer.Packet;
+}
+
+static inline void Endpoint_Read_Control_Stream_Chunk_LE(const void* const Buffer, uint16_t Length)
+{
+    // The real device waits for the next packet here, a host that does not send it hangs the bootloader
+    if (Emulator_SelectedEndpoint != ENDPOINT_CONTROLEP)
+    {
+        fprintf(stderr, "Emulator: blocking control stream read on endpoint 0x%02X\n", Emulator_SelectedEndpoint);
+        abort();
+    }
+    for (uint16_t i = 0; i < Length; i++)
+    {
+        uint16_t Position = Emulator_ControlTransfer.Position++;
+        if (Position == Emulator_ControlTransfer.Packet + HID_OUT_EPSIZE)
+        {
+            Emulator_ControlTransfer.Packet = Position;
+        }
+        if (Position >= Emulator_ControlTransfer.Length)
+        {
+            fprintf(stderr, "Emulator: waits for data stage byte %u of %u, the host never sends it\n",
+                Position, Emulator_ControlTransfer.Length);
+            abort();
+        }
+        ((uint8_t*)Buffer)[i] = Emulator_ControlTransfer.Data[Position];
+    }
+}
+
+static inline void Endpoint_Read_Control_Stream_LE(const void* const Buffer, uint16_t Length)
+{
+    Endpoint_Read_Control_Stream_Chunk_LE(Buffer, Length);
+    Endpoint_ClearOUT();
+}
+
+static inline void Endpoint_Write_Control_Stream_LE(const void* const Buffer, uint16_t Length)
+{
+    // Do not send more data than the host requests
+    if (Length > USB_ControlRequest.wLength)
+    {
+        Length = USB_ControlRequest.wLength;
+    }
+    memcpy(Emulator_ControlTransfer.Data, Buffer, Length);
+    Emulator_ControlTransfer.Length = Length;
+}
+
+static inline void USB_Init(void)
+{
+}
+
+static inline void USB_Detach(void)
+{
+}
+
+static inline void USB_Disable(void)
+{
+}
+
+static inline void USB_Device_ProcessControlRequest(void)
+{
+}
+
+#endif
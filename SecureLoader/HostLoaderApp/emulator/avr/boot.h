@@ -0,0 +1,16 @@
+// Host stand-in for <avr/boot.h>, SPM on the emulated flash with simulated timing
+#ifndef _EMULATOR_AVR_BOOT_H_
+#define _EMULATOR_AVR_BOOT_H_
+
+#include <avr/io.h>
+
+void boot_page_erase(uint32_t address);
+void boot_page_fill(uint32_t address, uint16_t data);
+void boot_page_write(uint32_t address);
+void boot_rww_enable(void);
+
+// Erase and write run in the background until the simulated SPM time passed
+bool boot_spm_busy(void);
+void boot_spm_busy_wait(void);
+
+#endif
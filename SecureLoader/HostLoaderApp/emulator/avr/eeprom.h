@@ -0,0 +1,33 @@
+// Host stand-in for <avr/eeprom.h>, EEMEM addresses are offsets into the emulated EEPROM
+#ifndef _EMULATOR_AVR_EEPROM_H_
+#define _EMULATOR_AVR_EEPROM_H_
+
+#include <string.h>
+#include <avr/io.h>
+
+#define EEMEM
+#define eeprom_busy_wait() do { } while (0)
+
+static inline uint8_t eeprom_read_byte(const uint8_t* address)
+{
+    return Emulator_EEPROM[(uintptr_t)address & E2END];
+}
+
+static inline void eeprom_write_byte(uint8_t* address, uint8_t value)
+{
+    Emulator_EEPROM[(uintptr_t)address & E2END] = value;
+}
+
+static inline void eeprom_update_byte(uint8_t* address, uint8_t value)
+{
+    eeprom_write_byte(address, value);
+}
+
+static inline void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        ((uint8_t*)dst)[i] = eeprom_read_byte((const uint8_t*)src + i);
+    }
+}
+
+#endif
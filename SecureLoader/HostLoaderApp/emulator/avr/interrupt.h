@@ -0,0 +1,8 @@
+// Host stand-in for <avr/interrupt.h>
+#ifndef _EMULATOR_AVR_INTERRUPT_H_
+#define _EMULATOR_AVR_INTERRUPT_H_
+
+#define sei() do { } while (0)
+#define cli() do { } while (0)
+
+#endif
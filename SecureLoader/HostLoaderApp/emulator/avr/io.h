@@ -0,0 +1,51 @@
+// Host stand-in for <avr/io.h>, only what SecureLoader.c uses of the ATmega32u4.
+// The memories and registers are defined in SecureLoaderEmu.c.
+#ifndef _EMULATOR_AVR_IO_H_
+#define _EMULATOR_AVR_IO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#ifndef SPM_PAGESIZE
+#define SPM_PAGESIZE 128
+#endif
+#ifndef FLASHEND
+#define FLASHEND 0x7FFF
+#endif
+#define E2END 0x3FF
+#define RAMSIZE 0xA00
+
+extern uint8_t Emulator_Flash[FLASHEND + 1];
+extern uint8_t Emulator_EEPROM[E2END + 1];
+extern uint8_t Emulator_SRAM[RAMSIZE];
+extern volatile uint8_t Emulator_IO[8];
+extern volatile uint16_t Emulator_IO16[2];
+
+// Pointers into the emulated SRAM instead of data space addresses
+#define RAMSTART (Emulator_SRAM)
+#define RAMEND (Emulator_SRAM + RAMSIZE - 1)
+
+#define MCUSR Emulator_IO[0]
+#define MCUCR Emulator_IO[1]
+#define PORTE Emulator_IO[2]
+#define DDRE Emulator_IO[3]
+#define TIFR1 Emulator_IO[4]
+#define TCCR1B Emulator_IO[5]
+#define TCCR1A Emulator_IO[6]
+#define GPIOR0 Emulator_IO[7]
+#define TCNT1 Emulator_IO16[0]
+#define OCR1A Emulator_IO16[1]
+
+// The button is never pressed
+#define PINE 0xFF
+
+#define WDRF 3
+#define IVSEL 1
+#define IVCE 0
+#define PORTE6 6
+#define OCF1A 1
+#define CS12 2
+#define CS10 0
+
+#endif
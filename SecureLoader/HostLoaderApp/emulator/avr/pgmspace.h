@@ -0,0 +1,13 @@
+// Host stand-in for <avr/pgmspace.h>, reads from the emulated flash
+#ifndef _EMULATOR_AVR_PGMSPACE_H_
+#define _EMULATOR_AVR_PGMSPACE_H_
+
+#include <avr/io.h>
+
+#define PROGMEM
+#define pgm_read_byte_near(address) (Emulator_Flash[(uint16_t)(address)])
+#define pgm_read_byte_far(address) (Emulator_Flash[(uint32_t)(address) & FLASHEND])
+#define pgm_read_word_near(address) \
+    (Emulator_Flash[(uint16_t)(address)] | (Emulator_Flash[(uint16_t)(address) + 1] << 8))
+
+#endif
@@ -0,0 +1,12 @@
+// Host stand-in for <avr/power.h>
+#ifndef _EMULATOR_AVR_POWER_H_
+#define _EMULATOR_AVR_POWER_H_
+
+#include <stdint.h>
+
+typedef uint8_t clock_div_t;
+#define clock_div_1 0
+#define clock_prescale_get() clock_div_1
+#define clock_prescale_set(division) do { } while (0)
+
+#endif
@@ -0,0 +1,9 @@
+// Host stand-in for <avr/wdt.h>, the emulator handles resets itself
+#ifndef _EMULATOR_AVR_WDT_H_
+#define _EMULATOR_AVR_WDT_H_
+
+#define WDTO_250MS 4
+#define wdt_enable(timeout) do { } while (0)
+#define wdt_disable() do { } while (0)
+
+#endif
@@ -0,0 +1,8 @@
+// Host stand-in for <util/delay.h>, the startup and exit delays are not simulated
+#ifndef _EMULATOR_UTIL_DELAY_H_
+#define _EMULATOR_UTIL_DELAY_H_
+
+#define _delay_ms(ms) do { } while (0)
+#define _delay_us(us) do { } while (0)
+
+#endif
@@ -0,0 +1,5 @@
+// Host stand-in for <util/setbaud.h>, the serial port is not emulated
+#ifndef _EMULATOR_UTIL_SETBAUD_H_
+#define _EMULATOR_UTIL_SETBAUD_H_
+
+#endif
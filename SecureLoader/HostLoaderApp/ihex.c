@@ -0,0 +1,380 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "ihex.h"
+
+/****************************************************************/
+/*                                                              */
+/*                     Read Intel Hex File                      */
+/*                                                              */
+/****************************************************************/
+
+// Contiguous run of data bytes from the hex file, sorted by address
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    unsigned char *data;
+} ihex_extent_t;
+
+// Loaded image. Extents point into one shared data buffer.
+static ihex_extent_t *extents = NULL;
+static int extent_count = 0;
+static int extent_alloc = 0;
+static unsigned char *extent_data = NULL;
+static size_t extent_data_len = 0;
+static size_t extent_data_alloc = 0;
+
+// One bit per flash page that contains any data
+static uint8_t *page_bitmap = NULL;
+static uint32_t page_count = 0;
+static uint32_t page_size = 128;
+
+// File that was loaded last, to skip reloading it if it did not change
+static char loaded_name[1024];
+static struct stat loaded_stat;
+static int loaded_count = -1;
+
+// Hex digit values plus one, zero marks invalid characters
+static const uint8_t hex_digit[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static int add_data(uint32_t addr, const unsigned char *bytes, int len);
+static int finish_extents(void);
+static int build_page_bitmap(void);
+static int find_extent(uint32_t addr);
+
+int read_intel_hex(const char *filename)
+{
+    // The same unchanged file is not parsed twice, e.g. after waiting for the device
+    struct stat st;
+    if (loaded_count >= 0 && !strcmp(filename, loaded_name) && !stat(filename, &st) &&
+        st.st_size == loaded_stat.st_size && st.st_mtime == loaded_stat.st_mtime) {
+        return loaded_count;
+    }
+
+    loaded_count = ihex_load_file(filename);
+    if (loaded_count >= 0 && strlen(filename) < sizeof(loaded_name) && !stat(filename, &loaded_stat)) {
+        strcpy(loaded_name, filename);
+    }
+    else {
+        loaded_count = -1;
+    }
+    return loaded_count;
+}
+
+int ihex_load_file(const char *filename)
+{
+    FILE *fp;
+    long size;
+    char *data;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        //printf("Unable to read file %s\n", filename);
+        return -1;
+    }
+
+    // Read the whole file with a single call
+    if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET)) {
+        fclose(fp);
+        return -1;
+    }
+    data = malloc(size + 1);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    int r = ihex_parse(data, size);
+    free(data);
+    return r;
+}
+
+// Decodes len bytes from hex pairs, returns the byte sum or -1 on invalid digits
+static inline int decode_hex(const unsigned char *ptr, int len, unsigned char *bytes)
+{
+    int sum = 0;
+    uint8_t invalid = 0;
+
+    while (len--) {
+        // Invalid digits wrap around to 0xFF
+        uint8_t hi = hex_digit[ptr[0]] - 1;
+        uint8_t lo = hex_digit[ptr[1]] - 1;
+        uint8_t byte = (hi << 4) | lo;
+        invalid |= hi | lo;
+        *bytes++ = byte;
+        sum += byte;
+        ptr += 2;
+    }
+    return (invalid & 0xF0) ? -1 : sum;
+}
+
+int ihex_parse(const char *data, size_t size)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    const unsigned char *end = ptr + size;
+    uint32_t extended_addr = 0;
+    int byte_count = 0;
+    unsigned char record[5 + 256];
+
+    // Drop the previous image, the buffers are reused
+    extent_count = 0;
+    extent_data_len = 0;
+    page_count = 0;
+
+    while (ptr < end) {
+        // Skip line endings and blank lines
+        if (*ptr == '\r' || *ptr == '\n' || *ptr == ' ' || *ptr == '\t') {
+            ptr++;
+            continue;
+        }
+        if (*ptr != ':' || end - ptr < 11) return -2;
+        ptr++;
+
+        // Length, address, type, data and checksum are all hex pairs
+        int len;
+        if (decode_hex(ptr, 1, record) < 0) return -2;
+        len = record[0];
+        if (end - ptr < 2 * (5 + len)) return -2;
+        int sum = decode_hex(ptr, 5 + len, record);
+        if (sum < 0 || (sum & 255)) return -2; /* checksum error */
+        ptr += 2 * (5 + len);
+
+        uint32_t addr = (record[1] << 8) | record[2];
+        int code = record[3];
+        unsigned char *bytes = record + 4;
+
+        if (code == 0) {
+            addr += extended_addr;
+            if (addr + len > MAX_MEMORY_SIZE) return -2;
+            if (add_data(addr, bytes, len) < 0) return -2;
+            byte_count += len;
+        }
+        else if (code == 1) {
+            break;
+        }
+        else if (code == 2 && len == 2) {
+            extended_addr = ((bytes[0] << 8) | bytes[1]) << 4;
+            //printf("ext addr = %05X\n", extended_addr);
+        }
+        else if (code == 4 && len == 2) {
+            extended_addr = (uint32_t)((bytes[0] << 8) | bytes[1]) << 16;
+            //printf("ext addr = %08X\n", extended_addr);
+        }
+        // Start address records (03, 05) are not needed
+    }
+
+    if (finish_extents() < 0 || build_page_bitmap() < 0) return -2;
+    return byte_count;
+}
+
+// Appends a data record, continuing the last extent if the record follows it
+static int add_data(uint32_t addr, const unsigned char *bytes, int len)
+{
+    if (len == 0) return 0;
+
+    if (extent_data_len + len > extent_data_alloc) {
+        size_t alloc = extent_data_alloc ? extent_data_alloc * 2 : 0x10000;
+        while (alloc < extent_data_len + len) alloc *= 2;
+        unsigned char *p = realloc(extent_data, alloc);
+        if (!p) return -1;
+        extent_data = p;
+        extent_data_alloc = alloc;
+    }
+
+    // Extents store offsets into extent_data while parsing,
+    // since the buffer may still move. finish_extents() fixes them up.
+    ihex_extent_t *last = extent_count ? &extents[extent_count - 1] : NULL;
+    if (last && last->start + last->len == addr &&
+        (size_t)last->data + last->len == extent_data_len) {
+        last->len += len;
+    }
+    else {
+        if (extent_count == extent_alloc) {
+            int alloc = extent_alloc ? extent_alloc * 2 : 64;
+            ihex_extent_t *p = realloc(extents, alloc * sizeof(*extents));
+            if (!p) return -1;
+            extents = p;
+            extent_alloc = alloc;
+        }
+        extents[extent_count].start = addr;
+        extents[extent_count].len = len;
+        extents[extent_count].data = (unsigned char *)extent_data_len;
+        extent_count++;
+    }
+    memcpy(extent_data + extent_data_len, bytes, len);
+    extent_data_len += len;
+    return 0;
+}
+
+static int compare_extents(const void *a, const void *b)
+{
+    const ihex_extent_t *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    // Keep the file order for equal addresses, later records win
+    return x->data < y->data ? -1 : 1;
+}
+
+// Sorts the extents by address and merges overlapping ones
+static int finish_extents(void)
+{
+    int i, count = 0, records = extent_count;
+    size_t total = 0;
+
+    for (i = 1; i < records; i++) {
+        if (extents[i - 1].start + extents[i - 1].len > extents[i].start) break;
+    }
+
+    // Usual case, records are in address order and do not overlap
+    if (i >= records) {
+        for (i = 0; i < records; i++) {
+            extents[i].data = extent_data + (size_t)extents[i].data;
+        }
+        return 0;
+    }
+
+    // Otherwise build a new buffer from the union of all extents
+    ihex_extent_t *order = malloc(records * sizeof(*order));
+    if (!order) return -1;
+    memcpy(order, extents, records * sizeof(*order));
+    qsort(extents, records, sizeof(*extents), compare_extents);
+
+    for (i = 0; i < records; i++) {
+        uint32_t end = extents[i].start + extents[i].len;
+        ihex_extent_t *m = count ? &extents[count - 1] : NULL;
+        if (m && m->start + m->len >= extents[i].start) {
+            if (end > m->start + m->len) m->len = end - m->start;
+        }
+        else {
+            extents[count].start = extents[i].start;
+            extents[count].len = extents[i].len;
+            count++;
+        }
+    }
+    extent_count = count;
+
+    unsigned char *data = malloc(extent_data_len);
+    if (!data) {
+        free(order);
+        extent_count = 0;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        extents[i].data = data + total;
+        total += extents[i].len;
+    }
+
+    // Copy the records again in file order,
+    // so later records overwrite earlier ones like in a flat image
+    for (i = 0; i < records; i++) {
+        ihex_extent_t *m = &extents[find_extent(order[i].start)];
+        memcpy(m->data + (order[i].start - m->start), extent_data + (size_t)order[i].data, order[i].len);
+    }
+    free(order);
+    free(extent_data);
+    extent_data = data;
+    extent_data_alloc = extent_data_len;
+    extent_data_len = total;
+    return 0;
+}
+
+// Marks every page that contains at least one byte of data
+static int build_page_bitmap(void)
+{
+    uint32_t end = extent_count ? extents[extent_count - 1].start + extents[extent_count - 1].len : 0;
+    uint32_t pages = (end + page_size - 1) / page_size;
+    static uint32_t bitmap_alloc = 0;
+
+    if ((pages + 7) / 8 > bitmap_alloc) {
+        uint8_t *p = realloc(page_bitmap, (pages + 7) / 8);
+        if (!p) return -1;
+        page_bitmap = p;
+        bitmap_alloc = (pages + 7) / 8;
+    }
+    if (pages) memset(page_bitmap, 0, (pages + 7) / 8);
+    page_count = pages;
+
+    for (int i = 0; i < extent_count; i++) {
+        uint32_t first = extents[i].start / page_size;
+        uint32_t last = (extents[i].start + extents[i].len - 1) / page_size;
+        for (uint32_t page = first; page <= last; page++) {
+            page_bitmap[page / 8] |= 1 << (page % 8);
+        }
+    }
+    return 0;
+}
+
+// Returns the index of the first extent that ends after addr
+static int find_extent(uint32_t addr)
+{
+    int low = 0, high = extent_count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (extents[mid].start + extents[mid].len <= addr) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+int ihex_set_page_size(int size)
+{
+    if (size <= 0) return -1;
+    page_size = size;
+    return build_page_bitmap();
+}
+
+int ihex_page_used(uint32_t addr)
+{
+    uint32_t page = addr / page_size;
+    if (page >= page_count) return 0;
+    return (page_bitmap[page / 8] >> (page % 8)) & 1;
+}
+
+uint32_t ihex_end_address(void)
+{
+    return extent_count ? extents[extent_count - 1].start + extents[extent_count - 1].len : 0;
+}
+
+int ihex_bytes_within_range(int begin, int end)
+{
+    if (begin < 0 || end < begin) return 0;
+
+    int i = find_extent(begin);
+    return i < extent_count && extents[i].start <= (uint32_t)end;
+}
+
+void ihex_get_data(int addr, int len, unsigned char *bytes)
+{
+    // Unused bytes read as erased flash
+    memset(bytes, 255, len > 0 ? len : 0);
+    if (addr < 0 || len <= 0) return;
+
+    uint32_t begin = addr, end = begin + len;
+    for (int i = find_extent(begin); i < extent_count && extents[i].start < end; i++) {
+        uint32_t from = extents[i].start > begin ? extents[i].start : begin;
+        uint32_t to = extents[i].start + extents[i].len < end ? extents[i].start + extents[i].len : end;
+        memcpy(bytes + (from - begin), extents[i].data + (from - extents[i].start), to - from);
+    }
+}
+
+const unsigned char *ihex_get_page(uint32_t addr, int len, unsigned char *buf)
+{
+    // A page inside a single extent is returned without copying
+    int i = find_extent(addr);
+    if (i < extent_count && extents[i].start <= addr &&
+        addr + len <= extents[i].start + extents[i].len) {
+        return extents[i].data + (addr - extents[i].start);
+    }
+    ihex_get_data(addr, len, buf);
+    return buf;
+}
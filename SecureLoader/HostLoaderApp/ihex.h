@@ -0,0 +1,33 @@
+
+#ifndef _IHEX_H_
+#define _IHEX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the highest address that may be used by the intel-hex data.
+// The image is stored sparse, so only the used parts take memory.
+#define MAX_MEMORY_SIZE 0x1000000
+
+// Intel Hex File Functions
+int read_intel_hex(const char *filename);
+int ihex_load_file(const char *filename);
+int ihex_parse(const char *data, size_t len);
+int ihex_bytes_within_range(int begin, int end);
+void ihex_get_data(int addr, int len, unsigned char *bytes);
+
+// Page based access, the page size is 128 bytes unless changed
+int ihex_set_page_size(int size);
+int ihex_page_used(uint32_t addr);
+const unsigned char *ihex_get_page(uint32_t addr, int len, unsigned char *buf);
+uint32_t ihex_end_address(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
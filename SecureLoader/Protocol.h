@@ -37,7 +37,104 @@ typedef union
     };
 } ProgrammFlashPage_t;
 
-// Set a flash page address, that can be requested by the host afterwards
+// Several consecutive flash pages with a single CBC-MAC over the header block and
+// all page data. The request is PROGRAMM_FLASH_PAGES_LENGTH(PageCount) bytes long,
+// PageCount is 2 up to BootloaderCapabilities_t.BatchPages and has to match the length.
+#define PROGRAMM_FLASH_PAGES_LENGTH(pages) (2 * AES256_CBC_LENGTH + (pages) * SPM_PAGESIZE)
+
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        union
+        {
+            struct
+            {
+                uint16_t PageAddress;
+                uint16_t PageCount;
+                uint16_t DataLength;
+            };
+            uint8_t padding[AES256_CBC_LENGTH];
+        };
+        // PageCount pages or DataLength bytes of compressed pages, followed by the CBC-MAC
+        uint8_t PageDataBytes[0];
+    };
+} ProgrammFlashPages_t;
+
+// Compressed pages, only on the HID OUT and bulk OUT endpoints. A DataLength
+// other than 0 replaces the page data by that many bytes of tokens, it has to
+// be shorter than the page data. Tokens do not cross pages. The CBC-MAC still
+// covers the header block and the expanded pages. Blank pages are only erased.
+#define COMPRESSED_RUN      0x80 // Run of (token & 0x3F) + 1 bytes...
+#define COMPRESSED_RUN_FF   0x40 // ...of 0xFF, otherwise of 0x00
+#define COMPRESSED_RUN_MAX  64
+#define COMPRESSED_LITERAL_MAX 128 // (token & 0x7F) + 1 bytes follow the token
+
+// ProgrammFlashPage_t and ProgrammFlashPages_t can also be sent to the HID
+// OUT endpoint, zero padded to full 64 byte reports. The request length is
+// taken from the header block, a PageCount of 0 means a single page.
+#define CAPABILITY_HID_OUT_ENDPOINT 0x01
+
+// The same requests can be sent to the bulk OUT endpoint of the optional
+// vendor interface (interface 1), padding is not needed there. The status
+// is sent on its bulk IN endpoint.
+#define CAPABILITY_VENDOR_BULK      0x02
+
+// DataLength of ProgrammFlashPages_t is supported
+#define CAPABILITY_COMPRESSED_PAGES 0x04
+
+// Features of the bootloader, older bootloaders stall this request
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        uint16_t PageSize;
+        uint8_t BatchPages;
+        uint8_t Features;
+        uint8_t KeyLength;      // Bootloader Key in bytes, older bootloaders send 0 for 32
+        uint8_t reserved[3];
+    };
+} BootloaderCapabilities_t;
+
+// Answer on the HID IN endpoint for every request on the HID OUT endpoint,
+// zero padded to a full report. It is sent once the CBC-MAC was checked,
+// before the pages are written.
+#define PROGRAMM_STATUS_OK          0x00
+#define PROGRAMM_STATUS_INVALID     0x01 // Out of range, the request was discarded
+#define PROGRAMM_STATUS_MAC_ERROR   0x02 // The bootloader exits
+#define PROGRAMM_STATUS_VERIFY_ERROR 0x03 // An earlier page failed to verify, PageAddress is that page
+
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        uint8_t Status;
+        uint8_t PageCount;
+        uint16_t PageAddress;
+    };
+} ProgrammStatus_t;
+
+// The device reads back every page after writing it and compares it with the
+// CRC16 of the received page. A failed page is reported by the next page
+// request, with PROGRAMM_STATUS_VERIFY_ERROR or a stall on the control endpoint,
+// and that request is discarded. The counts are cleared when they are read.
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        uint16_t PageCount;     // Pages verified, including unchanged pages
+        uint16_t ErrorCount;    // 0 if all pages are OK
+        uint16_t ErrorAddress;  // Last failed page, encoded like ProgrammFlashPage_t
+    };
+} VerifyStatus_t;
+
+// Set a flash page address, that can be requested by the host afterwards.
+// Every ReadFlashPage_t advances it by one page, so consecutive pages need
+// only one SetFlashPage_t.
 typedef union
 {
     uint8_t raw[0];
@@ -62,6 +159,49 @@ typedef union
     };
 } ReadFlashPage_t;
 
+// CBC-MAC over a range of application flash pages, calculated by the device.
+// The host sets the range and reads back the whole struct afterwards.
+// The range is also used by PageChecksums_t.
+// The MAC covers one header block (request, zero padding, FLASH_DIGEST_TAG
+// as last byte) followed by the page data. PageCount must not be 0.
+// Page requests need zero header padding, so both MACs never collide.
+#define FLASH_DIGEST_TAG 0x56
+
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        // Range requested by the host, PageAddress is encoded like in ProgrammFlashPage_t
+        union
+        {
+            uint8_t raw[0];
+            struct
+            {
+                uint16_t PageAddress;
+                uint16_t PageCount;
+            };
+        } request;
+        uint8_t cbcMac[AES256_CBC_LENGTH];
+    };
+} FlashDigest_t;
+
+// CRC16 (avr-libc _crc16_update, initial value 0xFFFF) of every page in the
+// range set with FlashDigest_t, up to PAGE_CHECKSUMS_MAX pages per request.
+// Not authenticated, the host only uses it to skip unchanged pages.
+#define PAGE_CHECKSUMS_MAX 64
+
+typedef union
+{
+    uint8_t raw[0];
+    struct
+    {
+        uint16_t PageAddress;
+        uint16_t PageCount;
+        uint16_t Checksums[PAGE_CHECKSUMS_MAX];
+    };
+} PageChecksums_t;
+
 // Data to simpler calculate the new Bootloader Key, IV prepended
 typedef union
 {
@@ -76,7 +216,12 @@ typedef union
             uint8_t raw[0];
             struct
             {
-                uint8_t BootloaderKey[32];
+                // An AES-128 key is zero padded, the request length does not change
+                union
+                {
+                    uint8_t BootloaderKey[AES_KEY_LENGTH];
+                    uint8_t BootloaderKeyBlocks[32];
+                };
                 uint8_t cbcMac[AES256_CBC_LENGTH];
             };
         } data;
@@ -35,12 +35,22 @@
 
 #include "SecureLoader.h"
 
-/** Flag to indicate if the bootloader should be running, or should exit and allow the application code to run
- *    via a soft reset. When cleared, the bootloader will abort, the USB interface will shut down and the application
- *    started via a forced watchdog reset.
+/** Flag to indicate if the bootloader should be running, or should exit and allow the application code to run.
+ *    When cleared, the bootloader will abort, the USB interface will shut down and the application started
+ *    via a forced watchdog reset.
  */
 static bool RunBootloader = true;
 
+/** Set by the start application command only. Then the application is started directly without the watchdog
+ *  reset, every other exit (CBC-MAC errors, button timeout) still resets the AVR.
+ */
+static bool StartApplicationCommand = false;
+
+#if F_CPU != F_USB
+/** Clock prescaler of the reset (CKDIV8 fuse), restored before the application is started directly. */
+static uint8_t ResetClockPrescale;
+#endif
+
 /** Magic lock for forced application start. If the HWBE fuse is programmed and BOOTRST is unprogrammed, the bootloader
  *  will start if the /HWB line of the AVR is held low and the system is reset. However, if the /HWB line is still held
  *  low when the application attempts to start via a watchdog reset, the bootloader will re-start. If set to the value
@@ -54,25 +64,51 @@ static volatile uint8_t* MagicBootKeyPtr = (volatile uint8_t *)RAMEND;
  */
 static uint8_t CheckButton ATTR_NO_INIT;
 
-// Temporary data for the protocol to work with
-static ProgrammFlashPage_t ProgrammFlashPage;
+// Temporary data for the protocol to work with.
+// A single page is streamed straight into the SPM page buffer. Only the pages
+// of a batch or compressed pages wait in RAM until the CBC-MAC is verified.
+static struct
+{
+    union
+    {
+        uint8_t block[AES256_CBC_LENGTH];
+        struct
+        {
+            uint16_t PageAddress;
+            uint16_t PageCount;
+            uint16_t DataLength;
+        };
+    };
+#if BATCH_PAGES > 1
+    uint8_t PageDataBytes[BATCH_PAGES][SPM_PAGESIZE];
+#endif
+} ProgrammFlashPage;
 static SetFlashPage_t SetFlashPage = { .PageAddress = 0xFFFF };
+static OUTEndpointState_t HIDOUTState;
+#if defined(VENDOR_BULK_INTERFACE)
+static OUTEndpointState_t BulkOUTState;
+#endif
 static ReadFlashPage_t ReadFlashPage;
 static newBootloaderKey_t newBootloaderKey = { .IV= {0} };
 static authenticateBootloader_t authenticateBootloader = { .IV= {0} };
+static FlashDigest_t FlashDigest;
+static PageChecksums_t PageChecksums;
+static VerifyStatus_t VerifyStatus;
 
 #ifdef USE_EEPROM_KEY
 // TODO set proper eeprom address space via makefile
-static uint8_t EEMEM BootloaderKeyEEPROM[32] =
+static uint8_t EEMEM BootloaderKeyEEPROM[AES_KEY_LENGTH] =
 {
     0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
     0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+#if !defined(AES128)
     0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
     0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+#endif
 };
 
 // Bootloader Key (local ram copy)
-static uint8_t BootloaderKeyRam[32];
+static uint8_t BootloaderKeyRam[AES_KEY_LENGTH];
 
 #else
 
@@ -86,8 +122,8 @@ typedef union
     uint16_t words[SPM_PAGESIZE/2];
     struct
     {
-        uint8_t padding[SPM_PAGESIZE - 32];
-        uint8_t BootloaderKey[32];
+        uint8_t padding[SPM_PAGESIZE - AES_KEY_LENGTH];
+        uint8_t BootloaderKey[AES_KEY_LENGTH];
     };
 } secureBootloaderSection_t;
 
@@ -107,6 +143,162 @@ static void writeSBS(void)
     BootloaderAPI_EraseFillWritePage(FLASHEND - 2 * SPM_PAGESIZE + 1, SBS.words);
 }
 
+static uint16_t FlashPageChecksum(address_size_t PageAddress)
+{
+    // Same CRC16 as PageChecksums_t
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i++)
+    {
+        crc = _crc16_update(crc, BootloaderAPI_ReadByte(PageAddress++));
+    }
+    return crc;
+}
+
+// Verified pages that are erased and written in the background. The bootloader runs
+// from the NRWW section and keeps receiving the next pages while the RWW section is busy.
+#define SPM_IDLE    0
+#define SPM_FILL    1
+#define SPM_ERASE   2
+#define SPM_WRITE   3
+
+static struct
+{
+    uint8_t State;
+    uint8_t Page;
+    uint8_t PageCount;
+    address_size_t Address;
+    uint16_t Checksum;
+    uint8_t Compare;
+    bool Blank;
+    bool VerifyError;
+} BackgroundSPM = { .State = SPM_IDLE };
+
+/** Loads one block of the page at BackgroundSPM.Address into the temporary page buffer.
+ *  The RWW section has to be readable, the checksum and the flash comparison are updated on the way.
+ */
+static void FillPageBlock(const uint8_t* block, uint16_t Offset)
+{
+    if (!Offset)
+    {
+        BackgroundSPM.Checksum = 0xFFFF;
+        BackgroundSPM.Compare = PAGE_IDENTICAL;
+        BackgroundSPM.Blank = true;
+    }
+
+    address_size_t Address = BackgroundSPM.Address + Offset;
+    for (uint8_t i = 0; i < AES256_CBC_LENGTH; i++)
+    {
+        BackgroundSPM.Checksum = _crc16_update(BackgroundSPM.Checksum, block[i]);
+
+        // Any change needs an erase, the datasheet does not allow writing a page twice
+        if (block[i] != BootloaderAPI_ReadByte(Address + i))
+        {
+            BackgroundSPM.Compare = PAGE_ERASE_WRITE;
+        }
+
+        // The page buffer is filled a word at a time
+        if (i & 1)
+        {
+            uint16_t Word = block[i - 1] | (block[i] << 8);
+            if (Word != 0xFFFF)
+            {
+                BackgroundSPM.Blank = false;
+            }
+            boot_page_fill(Address + i - 1, Word);
+        }
+    }
+}
+
+/** Erases the filled page, the write follows in the background. Identical pages are skipped.
+ *  Blank pages are only erased, the page buffer is discarded with the RWW section.
+ */
+static void StartPageWrite(void)
+{
+    BackgroundSPM.State = SPM_WRITE;
+    if (BackgroundSPM.Compare != PAGE_IDENTICAL)
+    {
+        boot_page_erase(BackgroundSPM.Address);
+        if (!BackgroundSPM.Blank)
+        {
+            BackgroundSPM.State = SPM_ERASE;
+        }
+    }
+}
+
+static bool ProcessSPM(void)
+{
+    // Wait for the running erase or write
+    if (boot_spm_busy())
+    {
+        return false;
+    }
+
+#if BATCH_PAGES > 1
+    // Copy the next RAM page of a batch into the temporary page buffer
+    if (BackgroundSPM.State == SPM_FILL)
+    {
+        uint8_t* data = ProgrammFlashPage.PageDataBytes[BackgroundSPM.Page];
+        for (uint16_t Offset = 0; Offset < SPM_PAGESIZE; Offset += AES256_CBC_LENGTH)
+        {
+            FillPageBlock(&data[Offset], Offset);
+        }
+        StartPageWrite();
+        return false;
+    }
+#endif
+
+    // Start the write once the erase is done (if any), the temporary page buffer is kept
+    if (BackgroundSPM.State == SPM_ERASE)
+    {
+        boot_page_write(BackgroundSPM.Address);
+        BackgroundSPM.State = SPM_WRITE;
+        return false;
+    }
+
+    // Re-enable RWW section, verify the page and continue with the next page.
+    // The RAM page may already hold the next request, so its checksum is compared.
+    if (BackgroundSPM.State == SPM_WRITE)
+    {
+        boot_rww_enable();
+        VerifyStatus.PageCount++;
+        if (FlashPageChecksum(BackgroundSPM.Address) != BackgroundSPM.Checksum)
+        {
+            VerifyStatus.ErrorCount++;
+            VerifyStatus.ErrorAddress = setPageAddress(BackgroundSPM.Address);
+            BackgroundSPM.VerifyError = true;
+        }
+        BackgroundSPM.Address += SPM_PAGESIZE;
+        BackgroundSPM.State = (++BackgroundSPM.Page < BackgroundSPM.PageCount) ? SPM_FILL : SPM_IDLE;
+        return false;
+    }
+    return true;
+}
+
+static void FinishSPM(void)
+{
+    while (!ProcessSPM());
+}
+
+#if BATCH_PAGES > 1
+static bool PageBufferFree(uint8_t Page)
+{
+    // A RAM page can be reused once it was copied into the temporary page buffer
+    return (BackgroundSPM.State == SPM_IDLE) || (Page < BackgroundSPM.Page) ||
+        ((Page == BackgroundSPM.Page) && (BackgroundSPM.State != SPM_FILL));
+}
+#endif
+
+static uint8_t GetProgrammPageCount(uint16_t length)
+{
+    // ProgrammFlashPage_t or ProgrammFlashPages_t with up to BATCH_PAGES pages
+    if ((length < PROGRAMM_FLASH_PAGES_LENGTH(1)) || (length > PROGRAMM_FLASH_PAGES_LENGTH(BATCH_PAGES)) ||
+        ((length - PROGRAMM_FLASH_PAGES_LENGTH(0)) % SPM_PAGESIZE))
+    {
+        return 0;
+    }
+    return (length - PROGRAMM_FLASH_PAGES_LENGTH(0)) / SPM_PAGESIZE;
+}
+
 // AES256 context variable
 static aes256_ctx_t ctx;
 
@@ -165,13 +357,38 @@ static inline void ButtonSetup(void)
     PORT_BUTTON |= (1 << PORTID_BUTTON);
 }
 
+static inline void WaitBruteForceDelay(void)
+{
+    // Timer1 was started by SetupHardware(), the compare flag stays set
+    while (!(TIFR1 & (1 << OCF1A)));
+}
+
+/** Clears the RAM, the stack included, and starts the application at address 0.
+ *  Inlined, so nothing is used from the stack afterwards.
+ */
+static inline void ClearRAMAndJump(void) __attribute__ ((always_inline, noreturn));
+static inline void ClearRAMAndJump(void)
+{
+    // RAMSTART and the RAM size are even, clear a word per step
+    for (uint16_t* p = (uint16_t*)RAMSTART; p < (uint16_t*)(RAMEND + 1); p++)
+    {
+        *p = 0x0000;
+    }
+
+    // Start application
+    ((void (*)(void))0x0000)();
+    __builtin_unreachable();
+}
+
 /** Special startup routine to check if the bootloader should be started
  */
 void Application_Jump_Check(void)
 {
-    // Turn off the watchdog, save reset source
+    // Turn off the watchdog, save reset source. MCUSR has to be cleared for that,
+    // the application finds the reset source in GPIOR0 instead.
     uint8_t mcusr_state = MCUSR;
     MCUSR = 0;
+    GPIOR0 = mcusr_state;
     wdt_disable();
 
     // On a watchdog reset check if the application requested the bootloader
@@ -195,28 +412,36 @@ void Application_Jump_Check(void)
     bool ApplicationValid = (pgm_read_word_near(0) != 0xFFFF);
     if (ApplicationValid)
     {
-        // Clear RAM
-        for (uint8_t* p = (uint8_t*)RAMSTART; p <= (uint8_t*)RAMEND; p++)
-        {
-            *p = 0x00;
-        }
-
-        // Start application
-        ((void (*)(void))0x0000)();
+        ClearRAMAndJump();
     }
 }
 
 
+/** Returns true once the host took the status stage of the last control request and the
+ *  status reports of the OUT endpoints, e.g. of a CBC-MAC error that ends the bootloader.
+ */
+static bool StatusSent(void)
+{
+    Endpoint_SelectEndpoint(HID_IN_EPADDR);
+    bool Sent = !Endpoint_GetBusyBanks();
+#if defined(VENDOR_BULK_INTERFACE)
+    Endpoint_SelectEndpoint(BULK_IN_EPADDR);
+    Sent = Sent && !Endpoint_GetBusyBanks();
+#endif
+    Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+    return Sent && Endpoint_IsINReady();
+}
+
 /** Main program entry point. This routine configures the hardware required
  *  by the bootloader, then continuously runs the bootloader processing routine
  *  until instructed to soft-exit.
  */
 int main(void)
 {
-    // Startup delay to avoid brute force
-    _delay_ms(1000);
+    // The init sections, S-box tables and key included, are done
+    TIMING_PIN_TOGGLE();
 
-    // Setup hardware required for the bootloader
+    // Setup hardware required for the bootloader, this starts the brute force delay
     SetupHardware();
 
     // Enable global interrupts so that the USB stack can function
@@ -228,6 +453,15 @@ int main(void)
         USB_Device_ProcessControlRequest();
 #endif
 
+        // Receive pages on the HID OUT endpoint
+        ProcessOUTEndpoint(HID_OUT_EPADDR, HID_IN_EPADDR, &HIDOUTState);
+#if defined(VENDOR_BULK_INTERFACE)
+        ProcessOUTEndpoint(BULK_OUT_EPADDR, BULK_IN_EPADDR, &BulkOUTState);
+#endif
+
+        // Continue programming the last page in the background
+        ProcessSPM();
+
         // Use a timeout if hardware button was used to enter bootloader mode
         if (CheckButton)
         {
@@ -249,17 +483,18 @@ int main(void)
         }
     } while (RunBootloader);
 
-    // Wait a short time to end all USB transactions and then disconnect
-    _delay_us(1000);
-
-    // Disconnect from the host.
-    // USB interface will be reset later along with the AVR.
-    USB_Detach();
+    // Finish the last page before the application may start
+    FinishSPM();
 
-    // Enable the watchdog and force a timeout to reset the AVR
-    wdt_enable(WDTO_250MS);
+    // Let the host complete the status stage of the last request and fetch the last status report, at most 10ms
+    for (uint16_t i = 0; (i < 1000) && !StatusSent(); i++)
+    {
+        _delay_us(10);
+    }
 
-    for (;;);
+    // Start of the handoff measurement, it ends with the first pin change of the application
+    TIMING_PIN_TOGGLE();
+    StartApplication();
 }
 
 /** Configures all hardware required for the bootloader. */
@@ -267,9 +502,18 @@ static void SetupHardware(void)
 {
 #if F_CPU != F_USB
     /* Disable clock division */
+    ResetClockPrescale = clock_prescale_get();
     clock_prescale_set(clock_div_1);
 #endif
 
+    /* Start the brute force delay, it runs while the host enumerates the device.
+       The application may have used Timer1 before it jumped to the bootloader. */
+    TCCR1A = 0;
+    TCNT1 = 0;
+    TIFR1 = (1 << OCF1A);
+    OCR1A = BRUTE_FORCE_DELAY_TICKS;
+    TCCR1B = (1 << CS12) | (1 << CS10);
+
     /* Relocate the interrupt vector table to the bootloader section */
     MCUCR = (1 << IVCE);
     MCUCR = (1 << IVSEL);
@@ -278,6 +522,421 @@ static void SetupHardware(void)
     USB_Init();
 }
 
+/** Leaves the bootloader. After the start application command the hardware used by the bootloader is put back
+ *  into its reset state and the application is started right away, instead of a watchdog reset that takes 250ms
+ *  and more. Every other exit and a missing application still reset the AVR with the watchdog.
+ */
+static void StartApplication(void)
+{
+    GlobalInterruptDisable();
+
+    if (!StartApplicationCommand || (pgm_read_word_near(0) == 0xFFFF))
+    {
+        USB_Detach();
+        wdt_enable(WDTO_15MS);
+        for (;;);
+    }
+
+    // Disconnect from the host and turn off the USB controller, its PLL and pad regulator
+    USB_Disable();
+
+    // Timer1 of the brute force delay and the button pull-up
+    TCCR1B = 0;
+    TCNT1 = 0;
+    OCR1A = 0;
+    TIFR1 = (1 << OCF1A);
+    PORT_BUTTON &= ~(1 << PORTID_BUTTON);
+
+#if F_CPU != F_USB
+    // Clock division of the CKDIV8 fuse
+    clock_prescale_set((clock_div_t)ResetClockPrescale);
+#endif
+
+    // Move the interrupt vector table back to the application section
+    MCUCR = (1 << IVCE);
+    MCUCR = 0;
+
+    ClearRAMAndJump();
+}
+
+
+/** CBC-MAC like the host, only AES encryption is needed. */
+static void UpdateCbcMac(ProgrammRequest_t* Request, const uint8_t* block)
+{
+    aesXorVectors(Request->cbcMac, block, AES256_CBC_LENGTH);
+    aes256_enc(Request->cbcMac, &ctx);
+}
+
+#if BATCH_PAGES > 1
+static bool IsBufferedRequest(const ProgrammRequest_t* Request)
+{
+    // The CBC-MAC of a batch or of compressed pages covers more than the page buffer can hold
+    return (Request->PageCount > 1) || ProgrammFlashPage.DataLength;
+}
+#endif
+
+/** Checks the header block of a request. A PageCount of 0 takes the count from the header block. */
+static uint8_t CheckProgrammHeader(ProgrammRequest_t* Request)
+{
+    uint8_t PageCount = Request->PageCount;
+
+    // The HID OUT endpoint has no request length, compressed pages need it
+    if (!PageCount)
+    {
+        PageCount = ProgrammFlashPage.PageCount ? ProgrammFlashPage.PageCount : 1;
+        if ((ProgrammFlashPage.PageCount > BATCH_PAGES) ||
+            (ProgrammFlashPage.DataLength >= PageCount * SPM_PAGESIZE))
+        {
+            return PROGRAMM_STATUS_INVALID;
+        }
+    }
+    else if (ProgrammFlashPage.DataLength)
+    {
+        return PROGRAMM_STATUS_INVALID;
+    }
+
+#if BATCH_PAGES == 1
+    // Without RAM pages every request is a single uncompressed page
+    if (ProgrammFlashPage.DataLength)
+    {
+        return PROGRAMM_STATUS_INVALID;
+    }
+#endif
+
+    // The rest of the header block has to be zero, so a FlashDigest_t CBC-MAC
+    // (FLASH_DIGEST_TAG in the last byte) can never be replayed as a page request
+    for (uint8_t i = 3 * sizeof(uint16_t); i < sizeof(ProgrammFlashPage.block); i++)
+    {
+        if (ProgrammFlashPage.block[i])
+        {
+            return PROGRAMM_STATUS_INVALID;
+        }
+    }
+
+    // Do not overwrite the bootloader or write out of bounds.
+    // A batch has to name its page count, so its CBC-MAC differs from a single page.
+    address_size_t PageAddress = getPageAddress(ProgrammFlashPage.PageAddress);
+    if ((PageAddress >= BOOT_START_ADDR) || (PageAddress & (SPM_PAGESIZE - 1)) ||
+        (PageCount > (BOOT_START_ADDR - PageAddress) / SPM_PAGESIZE) ||
+        ((PageCount > 1) && (ProgrammFlashPage.PageCount != PageCount)) ||
+        ((PageCount == 1) && (ProgrammFlashPage.PageCount > 1)))
+    {
+        return PROGRAMM_STATUS_INVALID;
+    }
+
+    Request->PageCount = PageCount;
+    memset(Request->cbcMac, 0x00, sizeof(Request->cbcMac));
+    UpdateCbcMac(Request, ProgrammFlashPage.block);
+    return PROGRAMM_STATUS_PENDING;
+}
+
+/** Checks the CBC-MAC of the host and starts programming the pages in the background. */
+static uint8_t FinishProgrammRequest(ProgrammRequest_t* Request)
+{
+    // Check if CBC-MAC matches, run the full loop to avoid timing attacks
+    bool error = false;
+    for (uint8_t i = 0; i < AES256_CBC_LENGTH; i++)
+    {
+        if (Request->cbcMac[i] != Request->block[i])
+        {
+            error = true;
+        }
+    }
+
+    // Abort if CBC-MAC does not match or an earlier page failed to verify.
+    // A streamed page is discarded from the page buffer, nothing was erased yet.
+    if (error || BackgroundSPM.VerifyError)
+    {
+        boot_rww_enable();
+        if (error)
+        {
+            return PROGRAMM_STATUS_MAC_ERROR;
+        }
+        BackgroundSPM.VerifyError = false;
+        return PROGRAMM_STATUS_VERIFY_ERROR;
+    }
+
+    // Start programming, the request is acknowledged before the pages are written
+    BackgroundSPM.Address = getPageAddress(ProgrammFlashPage.PageAddress);
+    BackgroundSPM.Page = 0;
+    BackgroundSPM.PageCount = Request->PageCount;
+#if BATCH_PAGES > 1
+    if (IsBufferedRequest(Request))
+    {
+        BackgroundSPM.State = SPM_FILL;
+        ProcessSPM();
+        return PROGRAMM_STATUS_OK;
+    }
+#endif
+    StartPageWrite();
+    return PROGRAMM_STATUS_OK;
+}
+
+/** Returns true if the next byte of a request has to wait for the background programming: the page buffer
+ *  before a streamed page, a RAM page of a batch that is not copied yet, or the previous request before
+ *  the CBC-MAC of a batch. Until then the data stays in the endpoint FIFO and the host is NAKed.
+ */
+static bool ProgrammRequestWaits(const ProgrammRequest_t* Request)
+{
+    uint16_t Offset = Request->Offset - AES256_CBC_LENGTH;
+    if ((Request->Offset < AES256_CBC_LENGTH) || (Offset % SPM_PAGESIZE))
+    {
+        return false;
+    }
+#if BATCH_PAGES > 1
+    if (IsBufferedRequest(Request))
+    {
+        uint8_t Page = Offset / SPM_PAGESIZE;
+        return (Page < Request->PageCount) ? !PageBufferFree(Page) : (BackgroundSPM.State != SPM_IDLE);
+    }
+#endif
+    return !Offset && (BackgroundSPM.State != SPM_IDLE);
+}
+
+/** Receives the next byte of ProgrammFlashPage_t or ProgrammFlashPages_t, check ProgrammRequestWaits() first.
+ *  The pages are streamed block by block into the page buffer or RAM and into the CBC-MAC.
+ *  Returns PROGRAMM_STATUS_PENDING until the request is complete or invalid.
+ */
+static uint8_t ReceiveProgrammByte(ProgrammRequest_t* Request, uint8_t Byte)
+{
+    uint16_t Offset = Request->Offset;
+
+    // Header block, the page count and address are checked once it is complete
+    if (Offset < AES256_CBC_LENGTH)
+    {
+        ProgrammFlashPage.block[Offset++] = Byte;
+        Request->Offset = Offset;
+        return (Offset == AES256_CBC_LENGTH) ? CheckProgrammHeader(Request) : PROGRAMM_STATUS_PENDING;
+    }
+
+    Offset -= AES256_CBC_LENGTH;
+    if (Offset < Request->PageCount * SPM_PAGESIZE)
+    {
+#if BATCH_PAGES > 1
+        if (IsBufferedRequest(Request))
+        {
+            // Pages wait in RAM, a wrong DataLength shifts the CBC-MAC of the host and fails the check
+            uint8_t* data = &ProgrammFlashPage.PageDataBytes[0][0];
+            uint8_t Count = 1;
+            if (ProgrammFlashPage.DataLength && !Request->Literal)
+            {
+                // A token that is too long is cut off at the end of the page, the CBC-MAC fails anyway
+                Count = (Byte & ((Byte & COMPRESSED_RUN) ? 0x3F : 0x7F)) + 1;
+                if (Count > SPM_PAGESIZE - (Offset % SPM_PAGESIZE))
+                {
+                    Count = SPM_PAGESIZE - (Offset % SPM_PAGESIZE);
+                }
+                if (!(Byte & COMPRESSED_RUN))
+                {
+                    Request->Literal = Count;
+                    return PROGRAMM_STATUS_PENDING;
+                }
+                memset(&data[Offset], (Byte & COMPRESSED_RUN_FF) ? 0xFF : 0x00, Count);
+            }
+            else
+            {
+                data[Offset] = Byte;
+                if (Request->Literal)
+                {
+                    Request->Literal--;
+                }
+            }
+
+            Request->Offset += Count;
+            for (uint16_t End = Offset + Count; Offset < End; Offset++)
+            {
+                if ((Offset % AES256_CBC_LENGTH) == AES256_CBC_LENGTH - 1)
+                {
+                    UpdateCbcMac(Request, &data[Offset - (AES256_CBC_LENGTH - 1)]);
+                }
+            }
+            return PROGRAMM_STATUS_PENDING;
+        }
+#endif
+
+        // A single page goes straight into the page buffer, the RWW section is readable
+        if (!Offset)
+        {
+            BackgroundSPM.Address = getPageAddress(ProgrammFlashPage.PageAddress);
+        }
+        Request->block[Offset % AES256_CBC_LENGTH] = Byte;
+        Request->Offset++;
+        if ((Offset % AES256_CBC_LENGTH) == AES256_CBC_LENGTH - 1)
+        {
+            UpdateCbcMac(Request, Request->block);
+            FillPageBlock(Request->block, Offset - (AES256_CBC_LENGTH - 1));
+        }
+        return PROGRAMM_STATUS_PENDING;
+    }
+
+    // CBC-MAC of the host
+    Offset -= Request->PageCount * SPM_PAGESIZE;
+    Request->block[Offset] = Byte;
+    Request->Offset++;
+    return (Offset == AES256_CBC_LENGTH - 1) ? FinishProgrammRequest(Request) : PROGRAMM_STATUS_PENDING;
+}
+
+/** Receives ProgrammFlashPage_t or ProgrammFlashPages_t with PageCount pages in the data stage of a
+ *  control request and starts programming the pages in the background.
+ *  The data stage is only acknowledged if the CBC-MAC was checked.
+ */
+static uint8_t ProgrammFlashPages(uint8_t PageCount)
+{
+    ProgrammRequest_t Request = { .Offset = 0, .PageCount = PageCount, .Literal = 0 };
+    uint8_t Status;
+    do
+    {
+        while (ProgrammRequestWaits(&Request))
+        {
+            ProcessSPM();
+        }
+
+        uint8_t Byte;
+        Endpoint_Read_Control_Stream_Chunk_LE(&Byte, sizeof(Byte));
+        Status = ReceiveProgrammByte(&Request, Byte);
+    } while (Status == PROGRAMM_STATUS_PENDING);
+
+    if (Status != PROGRAMM_STATUS_INVALID)
+    {
+        Endpoint_ClearOUT();
+    }
+    return Status;
+}
+
+/** The header block and the page buffer are shared, only one OUT endpoint receives a request at a time. */
+static bool OtherOUTRequest(const OUTEndpointState_t* State)
+{
+#if defined(VENDOR_BULK_INTERFACE)
+    return !State->Request.Offset && (HIDOUTState.Request.Offset || BulkOUTState.Request.Offset);
+#else
+    return false;
+#endif
+}
+
+/** Gives up a request the host did not send completely to an OUT endpoint. A streamed page is
+ *  discarded from the page buffer, nothing was erased yet.
+ */
+static void AbortOUTRequest(OUTEndpointState_t* State)
+{
+    if (State->Request.Offset)
+    {
+        State->Request.Offset = 0;
+        if (BackgroundSPM.State == SPM_IDLE)
+        {
+            boot_rww_enable();
+        }
+    }
+}
+
+/** Processes pages sent to an OUT endpoint and answers with a status report on the matching IN endpoint.
+ *  The HID and the vendor bulk endpoints both use 64 byte packets. Nothing waits for the host here:
+ *  a request is read as far as the FIFO holds it and continued in the next main loop passes, as are
+ *  the rest of an invalid request and a status the IN endpoint can not take yet. A new request stays
+ *  in the FIFO until the status was sent.
+ */
+static void ProcessOUTEndpoint(uint8_t OUTAddress, uint8_t INAddress, OUTEndpointState_t* State)
+{
+    // Send the status of the last request as full report
+    if (State->StatusPending)
+    {
+        Endpoint_SelectEndpoint(INAddress);
+        if (Endpoint_IsINReady())
+        {
+            for (uint8_t i = 0; i < HID_IN_EPSIZE; i++)
+            {
+                Endpoint_Write_8((i < sizeof(State->Status)) ? State->Status.raw[i] : 0x00);
+            }
+            Endpoint_ClearIN();
+            State->StatusPending = false;
+
+            // A wrong CBC-MAC ends the bootloader once the host got the status
+            if (State->Status.Status == PROGRAMM_STATUS_MAC_ERROR)
+            {
+                RunBootloader = false;
+            }
+        }
+    }
+
+    Endpoint_SelectEndpoint(OUTAddress);
+    if (Endpoint_IsOUTReceived())
+    {
+        // Discard the rest of an invalid request packet by packet
+        if (State->DiscardPackets)
+        {
+            State->DiscardPackets--;
+            Endpoint_ClearOUT();
+        }
+        else if (!State->StatusPending && !OtherOUTRequest(State))
+        {
+            WaitBruteForceDelay();
+
+            // Read what the bank holds, the packet is released once it is empty
+            uint8_t Result = PROGRAMM_STATUS_PENDING;
+            while (Endpoint_BytesInEndpoint() && !ProgrammRequestWaits(&State->Request))
+            {
+                Result = ReceiveProgrammByte(&State->Request, Endpoint_Read_8());
+                if (Result != PROGRAMM_STATUS_PENDING)
+                {
+                    break;
+                }
+            }
+            if (Result == PROGRAMM_STATUS_PENDING)
+            {
+                if (!Endpoint_BytesInEndpoint())
+                {
+                    Endpoint_ClearOUT();
+                }
+                Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+                return;
+            }
+
+            // The request is complete, the rest of the packet is padding
+            State->Request.Offset = 0;
+            Endpoint_ClearOUT();
+
+            ProgrammStatus_t Status;
+            Status.Status = Result;
+            Status.PageAddress = ProgrammFlashPage.PageAddress;
+
+            // The header block tells the length of an invalid request, it was in the first packet.
+            // An invalid page count or data length only discards the current packet.
+            uint16_t PageCount = ProgrammFlashPage.PageCount;
+            Status.PageCount = (PageCount <= BATCH_PAGES) ? PageCount : 0;
+            if (Status.Status == PROGRAMM_STATUS_INVALID)
+            {
+                uint8_t Packets = 1;
+                if (!PageCount)
+                {
+                    PageCount = 1;
+                }
+                if ((PageCount <= BATCH_PAGES) && (ProgrammFlashPage.DataLength < PageCount * SPM_PAGESIZE))
+                {
+                    uint16_t Length = PROGRAMM_FLASH_PAGES_LENGTH(PageCount);
+                    if (ProgrammFlashPage.DataLength)
+                    {
+                        Length = PROGRAMM_FLASH_PAGES_LENGTH(0) + ProgrammFlashPage.DataLength;
+                    }
+                    Packets = (Length + HID_OUT_EPSIZE - 1) / HID_OUT_EPSIZE;
+                }
+                State->DiscardPackets = Packets - 1;
+            }
+            else if (Status.Status == PROGRAMM_STATUS_VERIFY_ERROR)
+            {
+                Status.PageAddress = VerifyStatus.ErrorAddress;
+                Status.PageCount = 0;
+            }
+            else
+            {
+                CheckButton = 0;
+            }
+
+            // Answer with the header of the request
+            State->Status = Status;
+            State->StatusPending = true;
+        }
+    }
+    Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+}
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
  *    the device from the USB host before passing along unhandled control requests to the library for processing
@@ -288,6 +947,18 @@ static inline void EVENT_USB_Device_ControlRequest(void)
     // Get input data length
     uint16_t length = USB_ControlRequest.wLength;
 
+    // Only new pages may arrive while the last ones are still being programmed,
+    // all other requests read the flash or use SPM themselves
+    uint8_t PageCount = 0;
+    if (USB_ControlRequest.bRequest == HID_REQ_SetReport)
+    {
+        PageCount = GetProgrammPageCount(length);
+    }
+    if (!PageCount)
+    {
+        FinishSPM();
+    }
+
     /* Process HID specific control requests */
     switch (USB_ControlRequest.bRequest)
     {
@@ -297,6 +968,18 @@ static inline void EVENT_USB_Device_ControlRequest(void)
             // Acknowledge setup data
             Endpoint_ClearSETUP();
 
+            // The host gave up the requests it did not send completely to the OUT endpoints
+            AbortOUTRequest(&HIDOUTState);
+#if defined(VENDOR_BULK_INTERFACE)
+            AbortOUTRequest(&BulkOUTState);
+#endif
+
+            // Every request except SetFlashPage is signed or selects a range for a MAC
+            if (length != sizeof(SetFlashPage))
+            {
+                WaitBruteForceDelay();
+            }
+
             // Process SetFlashPage command
             if (length == sizeof(SetFlashPage))
             {
@@ -307,34 +990,23 @@ static inline void EVENT_USB_Device_ControlRequest(void)
                 // Do not validate PageAddress, we do this in the GetReport request.
                 if (SetFlashPage.PageAddress == COMMAND_STARTAPPLICATION)
                 {
+                    StartApplicationCommand = true;
                     RunBootloader = false;
                 }
             }
-            // Process ProgrammFlashPage command
-            else if (length == sizeof(ProgrammFlashPage))
+            // Process ProgrammFlashPage and ProgrammFlashPages command
+            else if (PageCount)
             {
-                // Read in the data
-                Endpoint_Read_Control_Stream_LE(ProgrammFlashPage.raw, sizeof(ProgrammFlashPage));
-
-                // Do not overwrite the bootloader or write out of bounds
-                address_size_t PageAddress = getPageAddress(ProgrammFlashPage.PageAddress);
-                if ((PageAddress >= BOOT_START_ADDR) || (PageAddress & (SPM_PAGESIZE - 1)))
-                {
-                    Endpoint_StallTransaction();
-                    return;
-                }
-
-                // Abort if CBC-MAC does not match
-                uint16_t dataLen = sizeof(ProgrammFlashPage) - sizeof(ProgrammFlashPage.cbcMac);
-                if (aes256CbcMacReverseCompare(&ctx, ProgrammFlashPage.raw, dataLen))
+                uint8_t Status = ProgrammFlashPages(PageCount);
+                if (Status != PROGRAMM_STATUS_OK)
                 {
-                    RunBootloader = false;
+                    if (Status == PROGRAMM_STATUS_MAC_ERROR)
+                    {
+                        RunBootloader = false;
+                    }
                     Endpoint_StallTransaction();
                     return;
                 }
-
-                // Programm flash page
-                BootloaderAPI_EraseFillWritePage(PageAddress, ProgrammFlashPage.PageDataWords);
             }
             // Process newBootloaderKey command
             else if (length == sizeof(newBootloaderKey.data))
@@ -343,8 +1015,8 @@ static inline void EVENT_USB_Device_ControlRequest(void)
                 Endpoint_Read_Control_Stream_LE(newBootloaderKey.data.raw, sizeof(newBootloaderKey.data));
 
                 // Abort if CBC-MAC does not match
-                uint16_t dataLen = sizeof(newBootloaderKey.data.BootloaderKey);
-                if (aes256CbcMacReverseCompare(&ctx, newBootloaderKey.data.BootloaderKey, dataLen))
+                uint16_t dataLen = sizeof(newBootloaderKey.data.BootloaderKeyBlocks);
+                if (aes256CbcMacReverseCompare(&ctx, newBootloaderKey.data.BootloaderKeyBlocks, dataLen))
                 {
                     RunBootloader = false;
                     Endpoint_StallTransaction();
@@ -368,6 +1040,27 @@ static inline void EVENT_USB_Device_ControlRequest(void)
                 // Reinitialize AES with the new key
                 initAES();
             }
+            // Process FlashDigest command
+            else if (length == sizeof(FlashDigest.request))
+            {
+                // Read in the data
+                Endpoint_Read_Control_Stream_LE(FlashDigest.request.raw, sizeof(FlashDigest.request));
+
+                // Only digest whole pages of the application section.
+                // An empty range would return the encrypted header block alone.
+                address_size_t PageAddress = getPageAddress(FlashDigest.request.PageAddress);
+                uint16_t PageCount = FlashDigest.request.PageCount;
+                if (!PageCount || (PageAddress >= BOOT_START_ADDR) || (PageAddress & (SPM_PAGESIZE - 1)) ||
+                    (PageCount > (BOOT_START_ADDR - PageAddress) / SPM_PAGESIZE))
+                {
+                    // Forget the range, so no request can use an invalid one
+                    FlashDigest.request.PageCount = 0;
+                    Endpoint_StallTransaction();
+                    return;
+                }
+
+                // Wait for the host to request the digest or the page checksums
+            }
             // Process authenticateBootloader command
             else if (length == sizeof(authenticateBootloader.data))
             {
@@ -428,8 +1121,95 @@ static inline void EVENT_USB_Device_ControlRequest(void)
                 ReadFlashPage.PageAddress = setPageAddress(SetFlashPage.PageAddress);
                 BootloaderAPI_ReadPage(SetFlashPage.PageAddress, ReadFlashPage.PageDataBytes);
 
-                // Write the page data to the PC
+                // Write the page data to the PC and continue with the next page
                 Endpoint_Write_Control_Stream_LE(ReadFlashPage.raw, sizeof(ReadFlashPage));
+                SetFlashPage.PageAddress += setPageAddress(SPM_PAGESIZE);
+            }
+            // Process FlashDigest request
+            else if (length == sizeof(FlashDigest))
+            {
+                // Range was validated by the FlashDigest command, none is set after an invalid one
+                address_size_t PageAddress = getPageAddress(FlashDigest.request.PageAddress);
+                uint16_t PageCount = FlashDigest.request.PageCount;
+                if (!PageCount)
+                {
+                    Endpoint_StallTransaction();
+                    return;
+                }
+
+                // Header block with the requested range
+                memset(FlashDigest.cbcMac, 0x00, sizeof(FlashDigest.cbcMac));
+                memcpy(FlashDigest.cbcMac, FlashDigest.request.raw, sizeof(FlashDigest.request));
+                FlashDigest.cbcMac[AES256_CBC_LENGTH - 1] = FLASH_DIGEST_TAG;
+                aes256_enc(FlashDigest.cbcMac, &ctx);
+
+                // CBC-MAC the flash directly, without a page buffer
+                while (PageCount--)
+                {
+                    for (uint8_t Block = 0; Block < SPM_PAGESIZE / AES256_CBC_LENGTH; Block++)
+                    {
+                        for (uint8_t i = 0; i < AES256_CBC_LENGTH; i++)
+                        {
+                            FlashDigest.cbcMac[i] ^= BootloaderAPI_ReadByte(PageAddress++);
+                        }
+                        aes256_enc(FlashDigest.cbcMac, &ctx);
+                    }
+                }
+
+                // Write the range and its CBC-MAC to the PC
+                Endpoint_Write_Control_Stream_LE(FlashDigest.raw, sizeof(FlashDigest));
+            }
+            // Process PageChecksums request
+            else if (length == sizeof(PageChecksums))
+            {
+                // Range was validated by the FlashDigest command
+                address_size_t PageAddress = getPageAddress(FlashDigest.request.PageAddress);
+                PageChecksums.PageAddress = FlashDigest.request.PageAddress;
+                PageChecksums.PageCount = FlashDigest.request.PageCount;
+                if (PageChecksums.PageCount > PAGE_CHECKSUMS_MAX)
+                {
+                    PageChecksums.PageCount = PAGE_CHECKSUMS_MAX;
+                }
+
+                // One pass over the flash, unused entries stay zero
+                memset(PageChecksums.Checksums, 0x00, sizeof(PageChecksums.Checksums));
+                for (uint8_t Page = 0; Page < PageChecksums.PageCount; Page++)
+                {
+                    PageChecksums.Checksums[Page] = FlashPageChecksum(PageAddress);
+                    PageAddress += SPM_PAGESIZE;
+                }
+
+                // Write the checksums to the PC
+                Endpoint_Write_Control_Stream_LE(PageChecksums.raw, sizeof(PageChecksums));
+            }
+            // Process VerifyStatus request
+            else if (length == sizeof(VerifyStatus))
+            {
+                // All pages were written and verified before this request, start new counts
+                Endpoint_Write_Control_Stream_LE(VerifyStatus.raw, sizeof(VerifyStatus));
+                memset(VerifyStatus.raw, 0x00, sizeof(VerifyStatus));
+                BackgroundSPM.VerifyError = false;
+            }
+            // Process BootloaderCapabilities request
+            else if (length == sizeof(BootloaderCapabilities_t))
+            {
+                // Tell the host how many pages fit into one ProgrammFlashPages command
+                // and which key size the bootloader was built for
+                BootloaderCapabilities_t Capabilities =
+                {
+                    .PageSize = SPM_PAGESIZE,
+                    .BatchPages = BATCH_PAGES,
+                    .KeyLength = AES_KEY_LENGTH,
+                    // Compressed pages are expanded into the RAM pages of a batch
+                    .Features = CAPABILITY_HID_OUT_ENDPOINT
+#if defined(VENDOR_BULK_INTERFACE)
+                              | CAPABILITY_VENDOR_BULK
+#endif
+#if BATCH_PAGES > 1
+                              | CAPABILITY_COMPRESSED_PAGES
+#endif
+                };
+                Endpoint_Write_Control_Stream_LE(Capabilities.raw, sizeof(Capabilities));
             }
             // Process authenticateBootloader request
             else if (length == sizeof(authenticateBootloader.data.challenge))
@@ -44,6 +44,7 @@
         #include <avr/interrupt.h>
         #include <stdbool.h>
         #include <avr/eeprom.h>
+        #include <util/crc16.h>
 
         #include "AES/aes256_cbc.h"
         #include "SERIAL/serial.h"
@@ -61,8 +62,50 @@
         /** Magic bootloader key to unlock forced application start mode. */
         #define MAGIC_BOOT_KEY	0x77
 
+        /** Brute force protection, signed requests are only processed this long after a reset.
+         *  Timer1 counts it with a prescaler of 1024 while the USB interface enumerates.
+         */
+        #ifndef BRUTE_FORCE_DELAY_MS
+            #define BRUTE_FORCE_DELAY_MS	1000
+        #endif
+        #define BRUTE_FORCE_DELAY_TICKS	((uint16_t)((F_CPU / 1024UL) * BRUTE_FORCE_DELAY_MS / 1000UL))
+
+        /** Maximum pages of a ProgrammFlashPages request. Every page of a batch is buffered in RAM,
+         *  single pages are streamed into the SPM page buffer. 1 disables batches, compressed pages
+         *  and the RAM pages. Larger values are opt-in until their size and RAM use were measured
+         *  with avr-size, see make sizes.
+         */
+        #ifndef BATCH_PAGES
+            #define BATCH_PAGES	1
+        #endif
+
+        /** Result of a request that is not complete yet, never sent to the host. */
+        #define PROGRAMM_STATUS_PENDING	0xFF
+
+    /* Type Defines: */
+        /** Progress of a ProgrammFlashPage_t or ProgrammFlashPages_t request, it is received byte by byte. */
+        typedef struct
+        {
+            uint16_t Offset; /**< Position in the expanded request (header, pages, CBC-MAC), 0 before the first byte */
+            uint8_t PageCount; /**< Pages of the request, 0 until the header block was checked on an OUT endpoint */
+            uint8_t Literal; /**< Bytes of the current compressed literal token that are still to come */
+            uint8_t cbcMac[AES256_CBC_LENGTH]; /**< CBC-MAC of the blocks received so far */
+            uint8_t block[AES256_CBC_LENGTH]; /**< Current block of a streamed page, then the CBC-MAC of the host */
+        } ProgrammRequest_t;
+
+        /** Progress of an OUT endpoint between main loop passes. */
+        typedef struct
+        {
+            uint8_t DiscardPackets; /**< Packets of an invalid request that still have to be discarded */
+            bool StatusPending; /**< Status is not sent yet, the next request waits in the FIFO */
+            ProgrammRequest_t Request; /**< Request that is still being received, it may span any number of packets */
+            ProgrammStatus_t Status;
+        } OUTEndpointState_t;
+
     /* Function Prototypes: */
         static void SetupHardware(void);
+        static void StartApplication(void) ATTR_NO_RETURN;
+        static void ProcessOUTEndpoint(uint8_t OUTAddress, uint8_t INAddress, OUTEndpointState_t* State);
 
         void Application_Jump_Check(void) ATTR_INIT_SECTION(3);
 
@@ -59,6 +59,14 @@
 			USB_Descriptor_Interface_t            HID_Interface;
 			USB_HID_Descriptor_HID_t              HID_VendorHID;
 			USB_Descriptor_Endpoint_t             HID_ReportINEndpoint;
+			USB_Descriptor_Endpoint_t             HID_ReportOUTEndpoint;
+
+#if defined(VENDOR_BULK_INTERFACE)
+			// Vendor Bulk Interface
+			USB_Descriptor_Interface_t            Bulk_Interface;
+			USB_Descriptor_Endpoint_t             Bulk_DataOUTEndpoint;
+			USB_Descriptor_Endpoint_t             Bulk_DataINEndpoint;
+#endif
 		} USB_Descriptor_Configuration_t;
 
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -68,6 +76,9 @@
 		enum InterfaceDescriptors_t
  		{
  			INTERFACE_ID_GenericHID = 0, /**< GenericHID interface descriptor ID */
+#if defined(VENDOR_BULK_INTERFACE)
+			INTERFACE_ID_VendorBulk = 1, /**< Vendor bulk interface descriptor ID */
+#endif
  		};
 
 	/* Macros: */
@@ -77,6 +88,21 @@
 		/** Size in bytes of the HID reporting IN endpoint. */
 		#define HID_IN_EPSIZE                64
 
+		/** Endpoint address of the HID data OUT endpoint. */
+		#define HID_OUT_EPADDR               (ENDPOINT_DIR_OUT | 2)
+
+		/** Size in bytes of the HID data OUT endpoint. */
+		#define HID_OUT_EPSIZE               64
+
+		/** Endpoint address of the vendor bulk OUT endpoint, takes the same requests as the HID OUT endpoint. */
+		#define BULK_OUT_EPADDR              (ENDPOINT_DIR_OUT | 3)
+
+		/** Endpoint address of the vendor bulk IN endpoint for the status reports. */
+		#define BULK_IN_EPADDR               (ENDPOINT_DIR_IN | 4)
+
+		/** Size in bytes of the vendor bulk endpoints. */
+		#define BULK_EPSIZE                  64
+
 	/* Type Defines: */
 		/** Enum for the device string descriptor IDs within the device. Each string descriptor should
 		 *  have a unique ID index associated with it, which can be used to refer to the string from
@@ -106,8 +132,11 @@
 				HID_RI_LOGICAL_MINIMUM(8, 0x00),
 				HID_RI_LOGICAL_MAXIMUM(8, 0xFF),
 				HID_RI_REPORT_SIZE(8, 0x08),
-				HID_RI_REPORT_COUNT(8, SPM_PAGESIZE + 16), //TODO
+				HID_RI_REPORT_COUNT(8, HID_OUT_EPSIZE),
 				HID_RI_OUTPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
+				HID_RI_USAGE(8, 0x03), /* Vendor Usage 3 */
+				HID_RI_REPORT_COUNT(8, HID_IN_EPSIZE),
+				HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
 			HID_RI_END_COLLECTION(0),
 		};
 
@@ -150,7 +179,11 @@
 					.Header                 = {.Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration},
 
 					.TotalConfigurationSize = sizeof(USB_Descriptor_Configuration_t),
+#if defined(VENDOR_BULK_INTERFACE)
+					.TotalInterfaces        = 2,
+#else
 					.TotalInterfaces        = 1,
+#endif
 
 					.ConfigurationNumber    = 1,
 					.ConfigurationStrIndex  = NO_DESCRIPTOR,
@@ -167,7 +200,7 @@
 					.InterfaceNumber        = INTERFACE_ID_GenericHID,
 					.AlternateSetting       = 0x00,
 
-					.TotalEndpoints         = 1,
+					.TotalEndpoints         = 2,
 
 					.Class                  = HID_CSCP_HIDClass,
 					.SubClass               = HID_CSCP_NonBootSubclass,
@@ -194,8 +227,56 @@
 					.EndpointAddress        = HID_IN_EPADDR,
 					.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 					.EndpointSize           = HID_IN_EPSIZE,
-					.PollingIntervalMS      = 0x05
+					.PollingIntervalMS      = 0x01
+				},
+
+			.HID_ReportOUTEndpoint =
+				{
+					.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+					.EndpointAddress        = HID_OUT_EPADDR,
+					.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+					.EndpointSize           = HID_OUT_EPSIZE,
+					.PollingIntervalMS      = 0x01
+				},
+
+#if defined(VENDOR_BULK_INTERFACE)
+			.Bulk_Interface =
+				{
+					.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+					.InterfaceNumber        = INTERFACE_ID_VendorBulk,
+					.AlternateSetting       = 0x00,
+
+					.TotalEndpoints         = 2,
+
+					.Class                  = USB_CSCP_VendorSpecificClass,
+					.SubClass               = USB_CSCP_VendorSpecificSubclass,
+					.Protocol               = USB_CSCP_VendorSpecificProtocol,
+
+					.InterfaceStrIndex      = NO_DESCRIPTOR
+				},
+
+			.Bulk_DataOUTEndpoint =
+				{
+					.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+					.EndpointAddress        = BULK_OUT_EPADDR,
+					.Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+					.EndpointSize           = BULK_EPSIZE,
+					.PollingIntervalMS      = 0x00
 				},
+
+			.Bulk_DataINEndpoint =
+				{
+					.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+					.EndpointAddress        = BULK_IN_EPADDR,
+					.Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+					.EndpointSize           = BULK_EPSIZE,
+					.PollingIntervalMS      = 0x00
+				},
+#endif
 		};
 
 		/** Language descriptor structure. This descriptor, located in SRAM memory, is returned when the host requests
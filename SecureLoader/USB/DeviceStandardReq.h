@@ -159,6 +159,9 @@
 
                 // Enable USB device address
                 USB_Device_EnableDeviceAddress();
+
+                // End of the reset to enumeration measurement
+                TIMING_PIN_TOGGLE();
             }
 
 
@@ -256,8 +259,15 @@
                 Endpoint_ClearStatusStageHostToDevice();
 
 #if !defined(CONTROL_ONLY_DEVICE)
-                /* Setup HID Report Endpoint */
+                /* Setup HID Report Endpoints, double banked OUT to receive while processing */
                 Endpoint_ConfigureEndpoint(HID_IN_EPADDR, EP_TYPE_INTERRUPT, HID_IN_EPSIZE, 1);
+                Endpoint_ConfigureEndpoint(HID_OUT_EPADDR, EP_TYPE_INTERRUPT, HID_OUT_EPSIZE, 2);
+
+#if defined(VENDOR_BULK_INTERFACE)
+                /* Setup vendor bulk endpoints */
+                Endpoint_ConfigureEndpoint(BULK_OUT_EPADDR, EP_TYPE_BULK, BULK_EPSIZE, 2);
+                Endpoint_ConfigureEndpoint(BULK_IN_EPADDR, EP_TYPE_BULK, BULK_EPSIZE, 2);
+#endif
 #endif
             }
 
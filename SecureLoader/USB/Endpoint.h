@@ -301,6 +301,20 @@
 						return ((UEINTX & (1 << TXINI)) ? true : false);
 					}
 
+					/** Retrieves the number of busy banks in the currently selected endpoint, which have been queued for
+					 *  transmission via the \ref Endpoint_ClearIN() command, or are awaiting acknowledgement via the
+					 *  \ref Endpoint_ClearOUT() command.
+					 *
+					 *  \ingroup Group_EndpointPacketManagement_AVR8
+					 *
+					 *  \return Total number of busy banks in the selected endpoint.
+					 */
+					static inline uint8_t Endpoint_GetBusyBanks(void) ATTR_ALWAYS_INLINE ATTR_WARN_UNUSED_RESULT;
+					static inline uint8_t Endpoint_GetBusyBanks(void)
+					{
+						return (UESTA0X & (0x03 << NBUSYBK0));
+					}
+
 					/** Determines if the selected OUT endpoint has received new packet from the host.
 					 *
 					 *  \ingroup Group_EndpointPacketManagement_AVR8
@@ -659,9 +673,16 @@
 				  while (Length);
 				}
 
-				static inline void Endpoint_Read_Control_Stream_LE(const void* const Buffer,
+				/** Reads the next part of the CONTROL data stage, so a request can be processed while it is received.
+				 *  Unlike \ref Endpoint_Read_Control_Stream_LE() the last packet is not acknowledged, call
+				 *  \ref Endpoint_ClearOUT() once the whole data stage was read.
+				 *
+				 *  \param[out] Buffer  Pointer to the destination data buffer to write to.
+				 *  \param[in]  Length  Number of bytes to read from the data stage.
+				 */
+				static inline void Endpoint_Read_Control_Stream_Chunk_LE(const void* const Buffer,
 																								 uint16_t Length) ATTR_NON_NULL_PTR_ARG(1);
-				static inline void Endpoint_Read_Control_Stream_LE(const void* const Buffer, uint16_t Length)
+				static inline void Endpoint_Read_Control_Stream_Chunk_LE(const void* const Buffer, uint16_t Length)
 				{
 				  // Store the data in the temporary buffer
 				  for (size_t i = 0; i < Length; i++)
@@ -676,6 +697,13 @@
 				    // Get next data byte
 				    ((uint8_t*)Buffer)[i] = Endpoint_Read_8();
 				  }
+				}
+
+				static inline void Endpoint_Read_Control_Stream_LE(const void* const Buffer,
+																								 uint16_t Length) ATTR_NON_NULL_PTR_ARG(1);
+				static inline void Endpoint_Read_Control_Stream_LE(const void* const Buffer, uint16_t Length)
+				{
+				  Endpoint_Read_Control_Stream_Chunk_LE(Buffer, Length);
 
 				  // Acknowledge reading to the host
 				  Endpoint_ClearOUT();